@@ -12,6 +12,8 @@ static const unsigned int borderpx  = 1;        /* border pixel of windows */
 static const unsigned int snap      = 32;       /* snap pixel */
 static const unsigned int systrayspacing = 2;   /* systray spacing */
 static const Bool showsystray       = True;     /* False means no systray */
+static const Bool backdrops         = True;     /* False means monitors are tracked by root pointer motion */
+static const Bool outlinedrag       = False;    /* True means move and resize draw an outline until release */
 static const Bool showbar           = True;     /* False means no bar */
 static const Bool topbar            = True;     /* False means bottom bar */
 
@@ -23,10 +25,11 @@ static const Rule rules[] = {
 	 *	WM_CLASS(STRING) = instance, class
 	 *	WM_NAME(STRING) = title
 	 */
-	/* class      instance    title       tags mask     isfloating   monitor */
-	{ "Gimp",     NULL,       NULL,       0,            True,        -1 },
-	{ "Firefox",  NULL,       NULL,       1 << 8,       False,       -1 },
+	/* class      instance    title       tags mask     isfloating   monitor  exact */
+	{ "Gimp",     NULL,       NULL,       0,            True,        -1,      False },
+	{ "Firefox",  NULL,       NULL,       1 << 8,       False,       -1,      False },
 };
+#define HAVE_RULES
 
 /* layout */
 static const float mfact      = 0.55; /* factor of master area size [0.05..0.95] */
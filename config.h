@@ -17,6 +17,8 @@ static const unsigned int borderpx = 2;        /* border pixel of windows */
 static const unsigned int snap     = 20;       /* snap pixel */
 static const unsigned int systrayspacing = 2;
 static const Bool showsystray      = True;
+static const Bool backdrops        = True;     /* False means monitors are tracked by root pointer motion */
+static const Bool outlinedrag      = False;    /* True means move and resize draw an outline until release */
 static const Bool topbar           = True;     /* False means bottom bar */
 
 /* tagging */
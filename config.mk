@@ -14,15 +14,23 @@ X11LIB = /usr/X11R6/lib
 XINERAMALIBS  = -lXinerama
 XINERAMAFLAGS = -DXINERAMA
 
+# Xrandr (1.5), comment if you don't want it
+XRANDRLIBS  = -lXrandr
+XRANDRFLAGS = -DXRANDR
+
+# Xsync, for _NET_WM_SYNC_REQUEST, comment if you don't want it
+XSYNCLIBS  = -lXext
+XSYNCFLAGS = -DXSYNC
+
 # includes and libs
 INCS = `pkg-config --cflags lua53`
 LIBS = `pkg-config --libs lua53`
 
 INCS += -I${X11INC} `pkg-config --cflags xft`
-LIBS += -L${X11LIB} -lX11 ${XINERAMALIBS} `pkg-config --libs xft`
+LIBS += -L${X11LIB} -lX11 ${XINERAMALIBS} ${XRANDRLIBS} ${XSYNCLIBS} `pkg-config --libs xft` -lpthread
 
 # flags
-CPPFLAGS = -D_BSD_SOURCE -D_POSIX_C_SOURCE=2 -DVERSION=\"${VERSION}\" ${XINERAMAFLAGS}
+CPPFLAGS = -D_BSD_SOURCE -D_POSIX_C_SOURCE=2 -DVERSION=\"${VERSION}\" ${XINERAMAFLAGS} ${XRANDRFLAGS} ${XSYNCFLAGS}
 CFLAGS   = -g -O0
 CFLAGS   += -std=c99 -Wall -Werror -Wno-variadic-macros -Wno-deprecated-declarations ${INCS} ${CPPFLAGS}
 LDFLAGS  = -g ${LIBS}
@@ -22,13 +22,16 @@
  */
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <locale.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -42,24 +45,31 @@
 #ifdef XINERAMA
 #include <X11/extensions/Xinerama.h>
 #endif /* XINERAMA */
+#ifdef XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif /* XRANDR */
+#ifdef XSYNC
+#include <X11/extensions/sync.h>
+#endif /* XSYNC */
 
 #include "dwm.h"
 #include "drw.h"
+#include "geom.h"
 #include "util.h"
 #include "l.h"
+#include "launch.h"
 
 /* macros */
 #define BUTTONMASK           (ButtonPressMask|ButtonReleaseMask)
 #define CLEANMASK(mask)      (mask & ~(numlockmask|LockMask) & \
 		(ShiftMask|ControlMask|Mod1Mask|Mod2Mask|Mod3Mask|Mod4Mask|Mod5Mask))
-#define INTERSECT(x,y,w,h,m) (MAX(0, MIN((x)+(w),(m)->wx+(m)->ww) - MAX((x),(m)->wx)) \
-		* MAX(0, MIN((y)+(h),(m)->wy+(m)->wh) - MAX((y),(m)->wy)))
+#define KEYHASH(keysym)      ((keysym) % LENGTH(bindings))
 #define ISVISIBLE(C)         ((C->tags & C->mon->tagset[C->mon->seltags]))
-#define LENGTH(X)            (sizeof X / sizeof X[0])
 #define MOUSEMASK            (BUTTONMASK|PointerMotionMask)
 #define WIDTH(X)             ((X)->w + 2 * (X)->bw)
 #define HEIGHT(X)            ((X)->h + 2 * (X)->bw)
 #define TAGMASK              ((1 << LENGTH(tags)) - 1)
+#define SYNCTIMEOUT          100 /* ms a client gets to repaint after a resize */
 
 #define SYSTEM_TRAY_REQUEST_DOCK    0
 #define _NET_SYSTEM_TRAY_ORIENTATION_HORZ 0
@@ -82,9 +92,12 @@
 enum { CurNormal, CurResize, CurMove, CurLast };        /* cursor */
 enum { NetSupported, NetSystemTray, NetSystemTrayOP, NetSystemTrayOrientation,
 	NetWMName, NetWMState, NetWMFullscreen, NetActiveWindow, NetWMWindowType,
-	NetWMWindowTypeDialog, NetClientList, NetLast }; /* EWMH atoms */
+	NetWMWindowTypeDialog, NetClientList, NetWMPid, NetStartupId, NetWMSyncRequest,
+	NetWMSyncRequestCounter, NetLast }; /* EWMH atoms */
 enum { Manager, Xembed, XembedInfo, XLast }; /* Xembed atoms */
 enum { WMProtocols, WMDelete, WMState, WMTakeFocus, WMLast }; /* default atoms */
+enum { ProtoDelete = 1 << 0, ProtoTakeFocus = 1 << 1,
+       ProtoSyncRequest = 1 << 2 }; /* Client.protocols */
 enum { ClkTagBar, ClkStatusText, ClkWinTitle, ClkClientWin, ClkRootWin,
        ClkLast }; /* clicks */
 
@@ -103,6 +116,17 @@ typedef struct {
 	const Arg arg;
 } Key;
 
+typedef struct Binding Binding;
+struct Binding {
+	unsigned int mod; /* as bound, compared through CLEANMASK */
+	KeySym keysym;
+	const Key *key; /* compiled-in binding from config.h, if any */
+	int ref;        /* Lua handler reference, 0 if none */
+	int nameref;    /* Lua string with the keysym's name, made along with ref */
+	KeyCode grabbed; /* keycode grabbed on the root window, 0 if none */
+	Binding *next;
+};
+
 typedef struct Systray   Systray;
 struct Systray {
 	Window win;
@@ -115,7 +139,9 @@ static Bool applysizehints(Client *c, int *x, int *y, int *w, int *h, Bool inter
 static void arrange(Monitor *m);
 static void arrangemon(Monitor *m);
 static void attach(Client *c);
+static void attachclass(Client *c);
 static void attachstack(Client *c);
+static Binding *bindingfor(unsigned int mod, KeySym keysym, Bool create);
 static void buttonpress(XEvent *e);
 static void checkotherwm(void);
 static void cleanup(void);
@@ -128,20 +154,27 @@ static void configurerequest(XEvent *e);
 static Monitor *createmon(void);
 static void destroynotify(XEvent *e);
 static void detach(Client *c);
+static void detachclass(Client *c);
 static void detachstack(Client *c);
+static Bool dragmotion(int *x, int *y, double *last, double frame);
 static void drawbar(Monitor *m);
 static void drawbars(void);
+static void drawoutline(GC gc, int x, int y, int w, int h);
 static void enternotify(XEvent *e);
 static void expose(XEvent *e);
 static void focus(Client *c);
 static void focusin(XEvent *e);
+static void geomchanged(void);
 static Atom getatomprop(Client *c, Atom prop);
 static Bool getrootptr(int *x, int *y);
 static long getstate(Window w);
 static Bool gettextprop(Window w, Atom atom, char *text, unsigned int size);
 static void grabbuttons(Client *c, Bool focused);
+static void grabkey(KeyCode code, unsigned int mod, Bool ungrab);
 static void grabkeys(void);
+static void initbindings(void);
 static void keypress(XEvent *e);
+static LaunchProc *launchfor(Client *c);
 void killclient(Client *);
 static void manage(Window w, XWindowAttributes *wa);
 static void mappingnotify(XEvent *e);
@@ -149,10 +182,17 @@ static void maprequest(XEvent *e);
 static void motionnotify(XEvent *e);
 static void movemouse(const Arg *arg);
 static Client *nexttiled(Client *c);
+static double now(void);
+static GC outlinebegin(void);
+static void outlineend(GC gc);
 static void pop(Client *);
 static void propertynotify(XEvent *e);
 static void pushdown(const Arg*);
+static void reapchildren(void);
+static void reapplyrules(Client *c);
 static Monitor *recttomon(int x, int y, int w, int h);
+static int refreshrate(Monitor *m);
+static void releasekeys(void);
 static void removesystrayicon(Client *i);
 static void resize(Client *c, int x, int y, int w, int h, Bool interact);
 static void resizebarwin(Monitor *m);
@@ -162,15 +202,20 @@ static void resizerequest(XEvent *e);
 static void restack(Monitor *m);
 static void run(void);
 static void scan(void);
-static Bool sendevent(Window w, Atom proto, int m,
+static void sendevent(Window w, Atom proto, int m,
 		long d0, long d1, long d2, long d3, long d4);
+static void sendgeometry(Client *c);
 static void setclientstate(Client *c, long state);
+static void settags(Client *c, unsigned int newtags);
 static void setfocus(Client *c);
 static void setfullscreen(Client *c, Bool fullscreen);
 static void setmfact(const Arg *arg);
 static void setup(void);
 static void showhide(Client *c);
 static void sigchld(int unused);
+static void syncdone(Client *c);
+static void syncexpire(void);
+static int synctimeout(void);
 void tag(Client *, unsigned int);
 static void tagmon(const Arg *arg);
 void togglefloating(Client *);
@@ -182,10 +227,13 @@ static void unmapnotify(XEvent *e);
 static Bool updategeom(void);
 static void updatebarpos(Monitor *m);
 static void updatebars(void);
+static void updateclass(Client *c);
 static void updateclientlist(void);
-static void updatenumlockmask(void);
+static Bool updatenumlockmask(void);
+static void updateprotocols(Client *c);
 static void updatesizehints(Client *c);
 static void updatestatus(void);
+static void updatesync(Client *c);
 static void updatesystray(void);
 static void updatesystrayicongeom(Client *i, int w, int h);
 static void updatesystrayiconstate(Client *i, XPropertyEvent *ev);
@@ -200,6 +248,10 @@ static int xerror(Display *dpy, XErrorEvent *ee);
 static int xerrordummy(Display *dpy, XErrorEvent *ee);
 static int xerrorstart(Display *dpy, XErrorEvent *ee);
 void zoom(Client *);
+#ifdef XSYNC
+static void initsync(void);
+static void syncnotify(XEvent *e);
+#endif /* XSYNC */
 
 /* variables */
 static Systray *systray = NULL;
@@ -211,6 +263,10 @@ static int sw, sh;           /* X display screen geometry width, height */
 int bh, blw = 0;      /* bar geometry */
 static int (*xerrorxlib)(Display *, XErrorEvent *);
 static unsigned int numlockmask = 0;
+static unsigned int grabnumlock = 0; /* numlockmask the key grabs were made with */
+static unsigned int grabgen = 1;     /* bumped when client button grabs go stale */
+static Binding *bindings[256]; /* hashed by keysym, numlockmask may change */
+static Client *classindex[64]; /* managed clients hashed by class */
 static void (*handler[LASTEvent]) (XEvent *) = {
 	[ButtonPress] = buttonpress,
 	[ClientMessage] = clientmessage,
@@ -229,54 +285,88 @@ static void (*handler[LASTEvent]) (XEvent *) = {
 	[UnmapNotify] = unmapnotify
 };
 static Atom wmatom[WMLast], netatom[NetLast], xatom[XLast];
+static unsigned int batchdepth = 0;
+static Bool batchfocus = False, batchkeys = False;
 static Bool running = True;
+static int chldpipe[2] = { -1, -1 }; /* SIGCHLD wakes up the event loop */
+static Bool geompending = False;
+#ifdef XRANDR
+static int randrbase = -1; /* first RandR event, -1 without RandR 1.5 */
+#endif /* XRANDR */
+#ifdef XSYNC
+static int syncbase = -1, syncerror; /* -1 without the Sync extension */
+#endif /* XSYNC */
+static int syncwaiting = 0; /* clients that haven't repainted yet */
+static Geom *geoms = NULL;  /* scratch for arrangemon */
+static int geomcap = 0;
 static Cur *cursor[CurLast];
 ClrScheme scheme[SchemeLast];
 static Display *dpy;
 Drw *drw;
 static Fnt *fnt;
-static Monitor *mons;
+Monitor *mons;
 Monitor *selmon;
 static Window root;
 
 /* configuration, allows nested code to access above variables */
 #include "config.h"
 
+/* config.h files from before rules[] was applied again don't have any */
+#ifdef HAVE_RULES
+#define NRULES LENGTH(rules)
+#else
+#define NRULES 0
+static const Rule *rules = NULL;
+#endif
+
 /* compile-time check if all tags fit into an unsigned int bit array. */
-struct NumTags { char limitexceeded[LENGTH(tags) > 31 ? -1 : 1]; };
+struct NumTags { char limitexceeded[LENGTH(tags) > MAXTAGS ? -1 : 1]; };
+
+static Client *tagindex[LENGTH(tags)]; /* managed clients by tag */
 
 /* function implementations */
 void
 applyrules(Client *c) {
-	const char *class, *instance;
-	XClassHint ch = { NULL, NULL };
+	LaunchProc *p;
+	const Rule *r;
+	Monitor *m;
+	unsigned int ruletags = 0;
+	int i;
 
 	/* rule matching */
-	c->isfloating = c->tags = 0;
-	XGetClassHint(dpy, c->win, &ch);
-	class    = ch.res_class ? ch.res_class : broken;
-	instance = ch.res_name  ? ch.res_name  : broken;
+	c->isfloating = False;
+	settags(c, 0);
+
+	/* windows of spawned programs go where they were launched from */
+	if((p = launchfor(c))) {
+		for(m = mons; m && m->num != p->mon; m = m->next);
+		if(m) {
+			c->mon = m;
+			settags(c, p->tags);
+		}
+	}
 
-	if (c->class)
-		free(c->class);
-	if (c->instance)
-		free(c->instance);
-	c->class = strdup(class);
-	c->instance = strdup(instance);
+	rule_match(c->class, c->classhash, c->instance, c->name, &c->rules);
+	for(i = rule_next(&c->rules, 0); i != -1; i = rule_next(&c->rules, i + 1)) {
+		r = rule_get(i);
+		c->isfloating = r->isfloating;
+		ruletags |= r->tags;
+		for(m = mons; m && m->num != r->monitor; m = m->next);
+		if(m)
+			c->mon = m;
+	}
+	if(ruletags & TAGMASK)
+		settags(c, ruletags & TAGMASK);
 
 	l_call_client_new(c);
 
-	if(ch.res_class)
-		XFree(ch.res_class);
-	if(ch.res_name)
-		XFree(ch.res_name);
 	if (c->tags != 0) /* Tags already applied by hook */
 		return;
 	if (c->mon->tagset[c->mon->seltags] == 0)
-		c->tags = ~0;
+		settags(c, ~0);
 	else
-		c->tags = c->tags & TAGMASK ? \
-		          c->tags & TAGMASK : c->mon->tagset[c->mon->seltags];
+		settags(c, c->tags & TAGMASK ? \
+		           c->tags & TAGMASK : c->mon->tagset[c->mon->seltags]);
 }
 
 Bool
@@ -346,6 +436,15 @@ applysizehints(Client *c, int *x, int *y, int *w, int *h, Bool interact) {
 
 void
 arrange(Monitor *m) {
+	if(batchdepth) {
+		if(m)
+			m->dirty = True;
+		else {
+			for(m = mons; m; m = m->next)
+				m->dirty = True;
+		}
+		return;
+	}
 	if(m)
 		showhide(m->stack);
 	else {
@@ -364,27 +463,49 @@ arrange(Monitor *m) {
 
 void
 arrangemon(Monitor *m) {
-	int i, n, h, mw, my, ty;
+	int i, n;
 	Client *c;
+	Geom *g;
+	const Geom *lg;
+	LayoutArgs a;
 
 	for(n = 0, c = nexttiled(m->clients); c; c = nexttiled(c->next), n++);
 	if(n == 0)
 		return;
+	if(n > geomcap) {
+		geomcap = n;
+		geoms = erealloc(geoms, geomcap * sizeof(Geom));
+	}
 
-	if(n > m->nmaster)
-		mw = m->nmaster ? m->ww * m->mfact : 0;
-	else
-		mw = m->ww;
-	for(i = my = ty = 0, c = nexttiled(m->clients); c; c = nexttiled(c->next), i++)
-		if(i < m->nmaster) {
-			h = MAX(1, (m->wh - my) / (MIN(n, m->nmaster) - i));
-			resize(c, m->wx, m->wy + my, mw - (2*c->bw), h - (2*c->bw), False);
-			my += HEIGHT(c);
-		} else {
-			h = MAX(1, (m->wh - ty) / (n - i));
-			resize(c, m->wx + mw, m->wy + ty, m->ww - mw - (2*c->bw), h - (2*c->bw), False);
-			ty += HEIGHT(c);
-		}
+	a.area.x = m->wx;
+	a.area.y = m->wy;
+	a.area.w = m->ww;
+	a.area.h = m->wh;
+	a.mfact = m->mfact;
+	a.nmaster = m->nmaster;
+	if(!(lg = layout_arrange(m->lt[m->sellt], &a, n, &m->lc))) {
+		/* a broken layout is replaced by the first one */
+		m->lt[m->sellt] = 0;
+		strncpy(m->ltsymbol, layout_get(0)->symbol, sizeof m->ltsymbol - 1);
+		if(!(lg = layout_arrange(0, &a, n, &m->lc)))
+			return;
+	}
+	/* size hints apply to the layout's geometry, the clients are only
+	 * touched below */
+	for(i = 0, c = nexttiled(m->clients); c; c = nexttiled(c->next), i++) {
+		g = &geoms[i];
+		g->x = lg[i].x;
+		g->y = lg[i].y;
+		g->w = lg[i].w - 2 * c->bw;
+		g->h = lg[i].h - 2 * c->bw;
+		applysizehints(c, &g->x, &g->y, &g->w, &g->h, False);
+	}
+	/* only clients whose geometry changed are configured */
+	for(i = 0, c = nexttiled(m->clients); c; c = nexttiled(c->next), i++) {
+		g = &geoms[i];
+		if(g->x != c->x || g->y != c->y || g->w != c->w || g->h != c->h)
+			resizeclient(c, g->x, g->y, g->w, g->h);
+	}
 }
 
 void
@@ -393,12 +514,81 @@ attach(Client *c) {
 	c->mon->clients = c;
 }
 
+void
+attachclass(Client *c) {
+	Client **bucket = &classindex[c->classhash % LENGTH(classindex)];
+
+	c->classnext = *bucket;
+	*bucket = c;
+}
+
 void
 attachstack(Client *c) {
 	c->snext = c->mon->stack;
 	c->mon->stack = c;
 }
 
+/* Between batchbegin and the matching batchend, arrange only marks monitors
+ * dirty, and focus(NULL) and key grabs are postponed. Batches nest. */
+void
+batchbegin(void) {
+	batchdepth++;
+}
+
+void
+batchend(void) {
+	Monitor *m;
+
+	if(--batchdepth)
+		return;
+	if(batchkeys)
+		grabkeys();
+	if(batchfocus) {
+		batchfocus = False;
+		focus(NULL);
+	}
+	for(m = mons; m; m = m->next) {
+		if(m->dirty) {
+			m->dirty = False;
+			arrange(m);
+		}
+	}
+}
+
+Binding *
+bindingfor(unsigned int mod, KeySym keysym, Bool create) {
+	Binding *b, **bucket;
+
+	bucket = &bindings[KEYHASH(keysym)];
+	for(b = *bucket; b; b = b->next)
+		if(b->keysym == keysym && CLEANMASK(b->mod) == CLEANMASK(mod))
+			return b;
+	if(!create)
+		return NULL;
+	b = ecalloc(1, sizeof(Binding));
+	b->mod = mod;
+	b->keysym = keysym;
+	b->next = *bucket;
+	*bucket = b;
+	return b;
+}
+
+int
+bindkey(unsigned int mod, KeySym keysym, int ref) {
+	Binding *b;
+	int old;
+
+	if(!(b = bindingfor(mod, keysym, ref != 0)))
+		return 0;
+	if(ref && !b->nameref)
+		b->nameref = l_keyname(keysym);
+	old = b->ref;
+	b->ref = ref;
+	if(!b->key && !ref != !old)
+		grabkeys();
+	return old;
+}
+
 void
 buttonpress(XEvent *e) {
 	unsigned int i, x, click, occ = 0;
@@ -462,6 +652,11 @@ checkotherwm(void) {
 	XSync(dpy, False);
 }
 
+Client *
+classclients(unsigned int hash) {
+	return classindex[hash % LENGTH(classindex)];
+}
+
 void
 cleanup(void) {
 	Monitor *m;
@@ -507,19 +702,20 @@ cleanupmon(Monitor *mon) {
 	}
 	XUnmapWindow(dpy, mon->barwin);
 	XDestroyWindow(dpy, mon->barwin);
+	if(mon->backdrop)
+		XDestroyWindow(dpy, mon->backdrop);
+	free(mon->lc.g);
 	free(mon);
+	geom_invalidate();
 }
 
 void
 clearurgent(Client *c) {
-	XWMHints *wmh;
-
 	c->isurgent = False;
-	if(!(wmh = XGetWMHints(dpy, c->win)))
+	if(!(c->wmhints.flags & XUrgencyHint))
 		return;
-	wmh->flags &= ~XUrgencyHint;
-	XSetWMHints(dpy, c->win, wmh);
-	XFree(wmh);
+	c->wmhints.flags &= ~XUrgencyHint;
+	XSetWMHints(dpy, c->win, &c->wmhints);
 }
 
 void
@@ -534,8 +730,7 @@ clientmessage(XEvent *e) {
 	   && cme->message_type == netatom[NetSystemTrayOP]) {
 		/* add systray icons */
 		if(cme->data.l[1] == SYSTEM_TRAY_REQUEST_DOCK) {
-			if(!(c = (Client *)calloc(1, sizeof(Client))))
-				errx(1, "fatal: could not malloc() %lu bytes", sizeof(Client));
+			c = ecalloc(1, sizeof(Client));
 			c->win = cme->data.l[2];
 			c->mon = selmon;
 			c->next = systray->icons;
@@ -623,6 +818,13 @@ configurenotify(XEvent *e) {
 	// TODO: updategeom handling sucks, needs to be simplified
 	if (ev->window != root)
 		return;
+#ifdef XRANDR
+	/* RandR tells which monitors changed, handled with its events */
+	if(randrbase != -1) {
+		geompending = True;
+		return;
+	}
+#endif /* XRANDR */
 
 	dirty = (sw != ev->width || sh != ev->height);
 	sw = ev->width;
@@ -675,11 +877,10 @@ configurerequest(XEvent *e) {
 				/* center in y direction */
 				c->y = m->my + (m->mh / 2 - HEIGHT(c) / 2);
 			}
-			if((ev->value_mask & (CWX|CWY))
-			   && !(ev->value_mask & (CWWidth|CWHeight)))
-				configure(c);
 			if(ISVISIBLE(c))
-				XMoveResizeWindow(dpy, c->win, c->x, c->y, c->w, c->h);
+				sendgeometry(c);
+			else
+				configure(c);
 		} else
 			configure(c);
 	} else {
@@ -702,12 +903,12 @@ Monitor *
 createmon(void) {
 	Monitor *m;
 
-	if(!(m = (Monitor *)calloc(1, sizeof(Monitor))))
-		errx(1, "fatal: could not malloc() %lu bytes\n", sizeof(Monitor));
+	m = ecalloc(1, sizeof(Monitor));
 	m->tagset[0] = m->tagset[1] = 0;
 	m->mfact = mfact;
 	m->nmaster = nmaster;
 	m->topbar = topbar;
+	strncpy(m->ltsymbol, layout_get(0)->symbol, sizeof m->ltsymbol - 1);
 	return m;
 }
 
@@ -733,6 +934,15 @@ detach(Client *c) {
 	*tc = c->next;
 }
 
+void
+detachclass(Client *c) {
+	Client **tc;
+
+	for(tc = &classindex[c->classhash % LENGTH(classindex)]; *tc && *tc != c; tc = &(*tc)->classnext);
+	if(*tc)
+		*tc = c->classnext;
+}
+
 void
 detachstack(Client *c) {
 	Client **tc, *t;
@@ -748,16 +958,58 @@ detachstack(Client *c) {
 
 Monitor *
 dirtomon(int dir) {
-	Monitor *m = NULL;
+	int n = geom_count();
 
-	if(dir > 0) {
-		if(!(m = selmon->next))
-			m = mons;
-	} else if(selmon == mons)
-		for(m = mons; m->next; m = m->next);
-	else
-		for(m = mons; m->next != selmon; m = m->next);
-	return m;
+	return geom_get((selmon->num + (dir > 0 ? 1 : n - 1)) % n);
+}
+
+/* Waits during a mouse drag until the client should follow the pointer
+ * again. Queued motion is drained, only the latest position is reported
+ * and at most once per frame. Returns False with the final position once
+ * the button is released. */
+Bool
+dragmotion(int *x, int *y, double *last, double frame) {
+	struct pollfd pfd = { .fd = ConnectionNumber(dpy), .events = POLLIN };
+	Bool moved = False;
+	XEvent ev;
+	double wait = 0;
+	int timeout, t;
+
+	for(;;) {
+		while(XCheckMaskEvent(dpy, MOUSEMASK|ExposureMask|SubstructureRedirectMask, &ev)) {
+			switch(ev.type) {
+			case ConfigureRequest:
+			case Expose:
+			case MapRequest:
+				handler[ev.type](&ev);
+				break;
+			case MotionNotify:
+				*x = ev.xmotion.x;
+				*y = ev.xmotion.y;
+				moved = True;
+				break;
+			case ButtonRelease:
+				*x = ev.xbutton.x;
+				*y = ev.xbutton.y;
+				return False;
+			}
+		}
+#ifdef XSYNC
+		while(syncbase != -1 && XCheckTypedEvent(dpy, syncbase + XSyncAlarmNotify, &ev))
+			syncnotify(&ev);
+#endif /* XSYNC */
+		syncexpire();
+		if(moved && (wait = *last + frame - now()) <= 0) {
+			*last = now();
+			return True;
+		}
+		/* rounded up, so the frame has passed when poll returns */
+		timeout = moved ? (int)wait + ((int)wait < wait) : -1;
+		if((t = synctimeout()) != -1 && (timeout == -1 || t < timeout))
+			timeout = t;
+		if(poll(&pfd, 1, timeout) == -1 && errno != EINTR)
+			err(1, "poll");
+	}
 }
 
 void
@@ -838,6 +1090,21 @@ drawbars(void) {
 		drawbar(m);
 }
 
+/* Drawing the same outline again erases it */
+void
+drawoutline(GC gc, int x, int y, int w, int h) {
+	XDrawRectangle(dpy, root, gc, x, y, w - 1, h - 1);
+}
+
+void *
+ecalloc(size_t nmemb, size_t size) {
+	void *p;
+
+	if(!(p = calloc(nmemb, size)))
+		errx(1, "fatal: could not malloc() %zu bytes", nmemb * size);
+	return p;
+}
+
 void
 enternotify(XEvent *e) {
 	Client *c;
@@ -857,6 +1124,13 @@ enternotify(XEvent *e) {
 	focus(c);
 }
 
+void *
+erealloc(void *p, size_t size) {
+	if(!(p = realloc(p, size)))
+		errx(1, "fatal: could not malloc() %zu bytes", size);
+	return p;
+}
+
 void
 expose(XEvent *e) {
 	Monitor *m;
@@ -868,6 +1142,10 @@ expose(XEvent *e) {
 
 void
 focus(Client *c) {
+	if(!c && batchdepth) {
+		batchfocus = True;
+		return;
+	}
 	if(!c || !ISVISIBLE(c))
 		for(c = selmon->stack; c && !ISVISIBLE(c); c = c->snext);
 	/* was if(selmon->sel) */
@@ -943,6 +1221,31 @@ focusstack(int off) {
 	restack(selmon);
 }
 
+/* Applies the monitor changes RandR reported. Monitors that kept their
+ * geometry aren't touched. */
+void
+geomchanged(void) {
+	Monitor *m;
+
+	geompending = False;
+	if(DisplayWidth(dpy, screen) != sw || DisplayHeight(dpy, screen) != sh) {
+		sw = DisplayWidth(dpy, screen);
+		sh = DisplayHeight(dpy, screen);
+		drw_resize(drw, sw, bh);
+	}
+	for(m = mons; m; m = m->next)
+		m->refresh = 0; /* modes may have changed */
+	batchbegin();
+	if(updategeom()) {
+		updatebars();
+		for(m = mons; m; m = m->next)
+			if(m->dirty)
+				resizebarwin(m);
+		updatesystray();
+	}
+	batchend();
+}
+
 Atom
 getatomprop(Client *c, Atom prop) {
 	int di;
@@ -1031,7 +1334,11 @@ grabbuttons(Client *c, Bool focused) {
 	unsigned int i, j;
 	unsigned int modifiers[] = { 0, LockMask, numlockmask, numlockmask|LockMask };
 
-	updatenumlockmask();
+	/* focus changes back and forth a lot, the grabs only depend on this */
+	if(c->grabgen == grabgen && c->grabfocused == focused)
+		return;
+	c->grabgen = grabgen;
+	c->grabfocused = focused;
 	XUngrabButton(dpy, AnyButton, AnyModifier, c->win);
 
 	if(!focused) {
@@ -1053,41 +1360,49 @@ grabbuttons(Client *c, Bool focused) {
 }
 
 void
-grabkey(int modifiers, KeySym ksym, int ungrab) {
-	int i;
-	unsigned int mods[] = { 0, LockMask, numlockmask, numlockmask|LockMask };
-	KeyCode code;
-
-	updatenumlockmask();
-
-	if(!(code = XKeysymToKeycode(dpy, ksym))) {
-		return;
-	}
+grabkey(KeyCode code, unsigned int mod, Bool ungrab) {
+	unsigned int i;
+	unsigned int modifiers[] = { 0, LockMask, grabnumlock, grabnumlock|LockMask };
 
-	for(i = 0; i < LENGTH(mods); i++) {
-		if (ungrab) {
-			XUngrabKey(dpy, code, modifiers | mods[i], root);
-		} else {
-			XGrabKey(dpy, code, modifiers | mods[i], root,
-						True, GrabModeAsync, GrabModeAsync);
-		}
+	for(i = 0; i < LENGTH(modifiers); i++) {
+		if(ungrab)
+			XUngrabKey(dpy, code, mod | modifiers[i], root);
+		else
+			XGrabKey(dpy, code, mod | modifiers[i], root,
+			         True, GrabModeAsync, GrabModeAsync);
 	}
 }
 
+/* Brings the grabs on the root window in line with the bindings table: keys
+ * that gained a handler are grabbed, keys that lost all handlers are
+ * ungrabbed and dropped, everything else is left alone. */
 void
 grabkeys(void) {
-	unsigned int i, j;
-	unsigned int modifiers[] = { 0, LockMask, numlockmask, numlockmask|LockMask };
-	KeyCode code;
-
-	updatenumlockmask();
+	unsigned int i;
+	Binding *b, **bp;
 
-	for(i = 0; i < LENGTH(keys); i++) {
-		if((code = XKeysymToKeycode(dpy, keys[i].keysym))) {
-			for(j = 0; j < LENGTH(modifiers); j++) {
-				XGrabKey(dpy, code, keys[i].mod | modifiers[j], root,
-						True, GrabModeAsync, GrabModeAsync);
+	if(batchdepth) {
+		batchkeys = True;
+		return;
+	}
+	batchkeys = False;
+	if(numlockmask != grabnumlock) {
+		releasekeys();
+		grabnumlock = numlockmask;
+	}
+	for(i = 0; i < LENGTH(bindings); i++) {
+		for(bp = &bindings[i]; (b = *bp);) {
+			if(b->ref || b->key) {
+				if(!b->grabbed && (b->grabbed = XKeysymToKeycode(dpy, b->keysym)))
+					grabkey(b->grabbed, CLEANMASK(b->mod), False);
+				bp = &b->next;
+				continue;
 			}
+			if(b->grabbed)
+				grabkey(b->grabbed, CLEANMASK(b->mod), True);
+			*bp = b->next;
+			l_unref(b->nameref);
+			free(b);
 		}
 	}
 }
@@ -1103,33 +1418,142 @@ isuniquegeom(XineramaScreenInfo *unique, size_t n, XineramaScreenInfo *info) {
 }
 #endif /* XINERAMA */
 
+#ifdef XRANDR
+static void
+initrandr(void) {
+	int errbase, major, minor;
+
+	if(!XRRQueryExtension(dpy, &randrbase, &errbase)
+	|| !XRRQueryVersion(dpy, &major, &minor)
+	|| major < 1 || (major == 1 && minor < 5)) {
+		randrbase = -1;
+		return;
+	}
+	XRRSelectInput(dpy, root, RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask
+	                          | RROutputChangeNotifyMask);
+}
+
+/* Brings the monitors in line with the RandR monitors. They are matched by
+ * name, so a monitor keeps its clients and tags while outputs come and go,
+ * and only monitors that were added or moved are marked dirty. */
+static Bool
+updaterandr(void) {
+	XRRMonitorInfo *info;
+	Monitor *m, *next, **found;
+	Client *c;
+	Bool dirty = False;
+	int i, n;
+
+	if(!(info = XRRGetMonitors(dpy, root, True, &n)) || n <= 0) {
+		/* nothing is lit, keep one monitor covering the screen */
+		if(info)
+			XRRFreeMonitors(info);
+		info = NULL;
+		n = 1;
+	}
+	found = ecalloc(n, sizeof(Monitor *));
+	for(m = mons; m; m = m->next)
+		for(i = 0; i < n; i++)
+			if(!found[i] && (info ? info[i].name : None) == m->name) {
+				found[i] = m;
+				break;
+			}
+	for(i = 0; i < n; i++) {
+		if(!found[i]) { /* new monitor */
+			for(m = mons; m && m->next; m = m->next);
+			found[i] = createmon();
+			found[i]->name = info ? info[i].name : None;
+			found[i]->mw = -1;
+			if(m)
+				m->next = found[i];
+			else
+				mons = found[i];
+		}
+		m = found[i];
+		if(info ? (info[i].x != m->mx || info[i].y != m->my
+		           || info[i].width != m->mw || info[i].height != m->mh)
+		        : (m->mx || m->my || m->mw != sw || m->mh != sh))
+		{
+			dirty = m->dirty = True;
+			m->mx = m->wx = info ? info[i].x : 0;
+			m->my = m->wy = info ? info[i].y : 0;
+			m->mw = m->ww = info ? info[i].width : sw;
+			m->mh = m->wh = info ? info[i].height : sh;
+			updatebarpos(m);
+		}
+	}
+	/* monitors that are gone hand their clients to the first one */
+	for(m = mons; m; m = next) {
+		next = m->next;
+		for(i = 0; i < n && found[i] != m; i++);
+		if(i < n)
+			continue;
+		dirty = found[0]->dirty = True;
+		while((c = m->clients)) {
+			m->clients = c->next;
+			detachstack(c);
+			c->mon = found[0];
+			attach(c);
+			attachstack(c);
+		}
+		if(m == selmon) {
+			selmon = found[0];
+			focus(NULL);
+		}
+		cleanupmon(m);
+	}
+	for(i = 0, m = mons; m; m = m->next)
+		m->num = i++;
+	if(!selmon)
+		selmon = mons;
+	free(found);
+	if(info)
+		XRRFreeMonitors(info);
+	return dirty;
+}
+#endif /* XRANDR */
+
 void
-keypress(XEvent *e) {
+initbindings(void) {
 	unsigned int i;
+	Binding *b;
+
+	for(i = 0; i < LENGTH(keys); i++) {
+		b = bindingfor(keys[i].mod, keys[i].keysym, True);
+		if(!b->key)
+			b->key = &keys[i];
+	}
+}
+
+void
+keypress(XEvent *e) {
+	unsigned int mod;
+	Binding *b;
 	KeySym keysym;
 	XKeyEvent *ev;
 
 	ev = &e->xkey;
 	keysym = XKeycodeToKeysym(dpy, (KeyCode)ev->keycode, 0);
+	mod = CLEANMASK(ev->state);
 
-	if (l_call_keypress(CLEANMASK(ev->state), keysym))
+	if(!(b = bindingfor(mod, keysym, False)))
 		return;
-
-	for(i = 0; i < LENGTH(keys); i++) {
-		if(keysym == keys[i].keysym
-		   && CLEANMASK(keys[i].mod) == CLEANMASK(ev->state)
-		   && keys[i].func)
-			keys[i].func(&(keys[i].arg));
-	}
+	batchbegin();
+	if((!b->ref || !l_call_keypress(b->ref, b->nameref, mod))
+	   && b->key && b->key->func)
+		b->key->func(&(b->key->arg));
+	batchend();
 }
 
 void
 killclient(Client *c) {
 	if(!c)
 		return;
-	if(sendevent(c->win, wmatom[WMDelete],
-	             NoEventMask, wmatom[WMDelete], CurrentTime, 0 , 0, 0))
+	if(c->protocols & ProtoDelete) {
+		sendevent(c->win, wmatom[WMDelete],
+		          NoEventMask, wmatom[WMDelete], CurrentTime, 0 , 0, 0);
 		return;
+	}
 
 	XGrabServer(dpy);
 	XSetErrorHandler(xerrordummy);
@@ -1140,19 +1564,43 @@ killclient(Client *c) {
 	XUngrabServer(dpy);
 }
 
+LaunchProc *
+launchfor(Client *c) {
+	int di;
+	unsigned long dl, n;
+	unsigned char *p = NULL;
+	Atom da;
+	pid_t pid = 0;
+	char id[sizeof(((LaunchProc *)0)->startupid)];
+
+	if(XGetWindowProperty(dpy, c->win, netatom[NetWMPid], 0L, 1L, False, XA_CARDINAL,
+	                      &da, &di, &n, &dl, &p) == Success && p) {
+		if(n == 1)
+			pid = *(long *)p;
+		XFree(p);
+	}
+	if(!gettextprop(c->win, netatom[NetStartupId], id, sizeof id))
+		id[0] = '\0';
+	return launch_match(pid, id);
+}
+
 void
 manage(Window w, XWindowAttributes *wa) {
 	Client *c, *t = NULL;
 	Window trans = None;
 	XWindowChanges wc;
 
-	if(!(c = calloc(1, sizeof(Client))))
-		errx(1, "fatal: could not malloc() %lu bytes\n", sizeof(Client));
+	c = ecalloc(1, sizeof(Client));
 	c->win = w;
 	updatetitle(c);
-	if(XGetTransientForHint(dpy, w, &trans) && (t = wintoclient(trans))) {
+	updateclass(c);
+	updateprotocols(c);
+	c->transientfor = XGetTransientForHint(dpy, w, &trans) ? trans : None;
+	if(c->transientfor != None && (t = wintoclient(c->transientfor))) {
 		c->mon = t->mon;
-		c->tags = t->tags;
+		settags(c, t->tags);
+		/* not applied, only so reapplyrules sees them as old matches */
+		rule_match(c->class, c->classhash, c->instance, c->name, &c->rules);
 	} else {
 		c->mon = selmon;
 		applyrules(c);
@@ -1178,6 +1626,7 @@ manage(Window w, XWindowAttributes *wa) {
 	XConfigureWindow(dpy, w, CWBorderWidth, &wc);
 	XSetWindowBorder(dpy, w, scheme[SchemeNorm].border->rgb.pixel);
 	configure(c); /* propagates border_width, if size doesn't change */
+	c->winstate = getatomprop(c, netatom[NetWMState]);
 	updatewindowtype(c);
 	updatesizehints(c);
 	updatewmhints(c);
@@ -1196,6 +1645,12 @@ manage(Window w, XWindowAttributes *wa) {
 	                (unsigned char *) &(c->win), 1);
 	/* some windows require this */
 	XMoveResizeWindow(dpy, c->win, c->x + 2 * sw, c->y, c->w, c->h);
+	c->sent.x = c->x + 2 * sw;
+	c->sent.y = c->y;
+	c->sent.width = c->w;
+	c->sent.height = c->h;
+	c->sent.border_width = c->bw;
+	c->ishidden = True; /* until showhide puts it in place */
 	setclientstate(c, NormalState);
 	if (c->mon == selmon)
 		unfocus(selmon->sel, False);
@@ -1208,10 +1663,26 @@ manage(Window w, XWindowAttributes *wa) {
 void
 mappingnotify(XEvent *e) {
 	XMappingEvent *ev = &e->xmapping;
+	Bool changed;
+	Client *c;
+	Monitor *m;
 
 	XRefreshKeyboardMapping(ev);
-	if(ev->request == MappingKeyboard)
+	if(ev->request != MappingKeyboard && ev->request != MappingModifier)
+		return;
+	changed = updatenumlockmask();
+	if(ev->request == MappingKeyboard) {
+		/* keycodes may have moved, start over */
+		releasekeys();
+		grabkeys();
+	} else if(changed)
 		grabkeys();
+	if(changed) {
+		grabgen++;
+		for(m = mons; m; m = m->next)
+			for(c = m->clients; c; c = c->next)
+				grabbuttons(c, c == selmon->sel);
+	}
 }
 
 void
@@ -1242,7 +1713,9 @@ motionnotify(XEvent *e) {
 
 	if(ev->window != root)
 		return;
-	if((m = recttomon(ev->x_root, ev->y_root, 1, 1)) != mon && mon) {
+	if(!(m = geom_point(ev->x_root, ev->y_root)))
+		m = selmon;
+	if(m != mon && mon) {
 		unfocus(selmon->sel, True);
 		selmon = m;
 		focus(NULL);
@@ -1252,58 +1725,64 @@ motionnotify(XEvent *e) {
 
 void
 movemouse(const Arg *arg) {
-	int x, y, ocx, ocy, nx, ny;
+	int x, y, px, py, ocx, ocy, nx, ny, o[4];
+	Bool moving, drawn = False;
+	double last = 0, frame;
 	Client *c;
 	Monitor *m;
-	XEvent ev;
-	Time lasttime = 0;
+	GC gc = NULL;
 
 	if(!(c = selmon->sel))
 		return;
 	if(c->isfullscreen) /* no support moving fullscreen windows by mouse */
 		return;
 	restack(selmon);
-	ocx = c->x;
-	ocy = c->y;
+	ocx = nx = c->x;
+	ocy = ny = c->y;
 	if(XGrabPointer(dpy, root, False, MOUSEMASK, GrabModeAsync, GrabModeAsync,
 	                None, cursor[CurMove]->cursor, CurrentTime) != GrabSuccess)
 		return;
 	if(!getrootptr(&x, &y))
 		return;
+	frame = 1000.0 / refreshrate(selmon);
+	if(outlinedrag) {
+		batchbegin(); /* no arrange may paint beneath the outline */
+		gc = outlinebegin();
+	}
 	do {
-		XMaskEvent(dpy, MOUSEMASK|ExposureMask|SubstructureRedirectMask, &ev);
-		switch(ev.type) {
-		case ConfigureRequest:
-		case Expose:
-		case MapRequest:
-			handler[ev.type](&ev);
-			break;
-		case MotionNotify:
-			if ((ev.xmotion.time - lasttime) <= (1000 / 60))
-				continue;
-			lasttime = ev.xmotion.time;
-
-			nx = ocx + (ev.xmotion.x - x);
-			ny = ocy + (ev.xmotion.y - y);
-			if(nx >= selmon->wx && nx <= selmon->wx + selmon->ww
-			   && ny >= selmon->wy && ny <= selmon->wy + selmon->wh) {
-				if(abs(selmon->wx - nx) < snap)
-					nx = selmon->wx;
-				else if(abs((selmon->wx + selmon->ww) - (nx + WIDTH(c))) < snap)
-					nx = selmon->wx + selmon->ww - WIDTH(c);
-				if(abs(selmon->wy - ny) < snap)
-					ny = selmon->wy;
-				else if(abs((selmon->wy + selmon->wh) - (ny + HEIGHT(c))) < snap)
-					ny = selmon->wy + selmon->wh - HEIGHT(c);
-				if(!c->isfloating
-				   && (abs(nx - c->x) > snap || abs(ny - c->y) > snap))
-					togglefloating(NULL);
-			}
-			if(c->isfloating)
-				resize(c, nx, ny, c->w, c->h, True);
-			break;
+		moving = dragmotion(&px, &py, &last, frame);
+		if(drawn)
+			drawoutline(gc, o[0], o[1], o[2], o[3]);
+		drawn = False;
+		nx = ocx + (px - x);
+		ny = ocy + (py - y);
+		if(nx >= selmon->wx && nx <= selmon->wx + selmon->ww
+		   && ny >= selmon->wy && ny <= selmon->wy + selmon->wh) {
+			if(abs(selmon->wx - nx) < snap)
+				nx = selmon->wx;
+			else if(abs((selmon->wx + selmon->ww) - (nx + WIDTH(c))) < snap)
+				nx = selmon->wx + selmon->ww - WIDTH(c);
+			if(abs(selmon->wy - ny) < snap)
+				ny = selmon->wy;
+			else if(abs((selmon->wy + selmon->wh) - (ny + HEIGHT(c))) < snap)
+				ny = selmon->wy + selmon->wh - HEIGHT(c);
+			if(!c->isfloating
+			   && (abs(nx - c->x) > snap || abs(ny - c->y) > snap))
+				togglefloating(NULL);
 		}
-	} while(ev.type != ButtonRelease);
+		if(!c->isfloating)
+			continue;
+		if(gc && moving) {
+			o[0] = nx; o[1] = ny; o[2] = WIDTH(c); o[3] = HEIGHT(c);
+			drawoutline(gc, o[0], o[1], o[2], o[3]);
+			drawn = True;
+		} else
+			resize(c, nx, ny, c->w, c->h, True);
+	} while(moving);
+	if(gc) {
+		outlineend(gc);
+		batchend();
+	}
 	XUngrabPointer(dpy, CurrentTime);
 	if((m = recttomon(c->x, c->y, c->w, c->h)) != selmon) {
 		sendmon(c, m);
@@ -1318,6 +1797,34 @@ nexttiled(Client *c) {
 	return c;
 }
 
+double
+now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* The outline is xor'ed onto the screen, so nothing may be drawn beneath
+ * it while it's shown */
+GC
+outlinebegin(void) {
+	XGCValues gcv;
+
+	gcv.function = GXxor;
+	gcv.foreground = WhitePixel(dpy, screen) ^ BlackPixel(dpy, screen);
+	gcv.subwindow_mode = IncludeInferiors;
+	gcv.line_width = MAX(borderpx, 1);
+	XGrabServer(dpy);
+	return XCreateGC(dpy, root, GCFunction|GCForeground|GCSubwindowMode|GCLineWidth, &gcv);
+}
+
+void
+outlineend(GC gc) {
+	XFreeGC(dpy, gc);
+	XUngrabServer(dpy);
+}
+
 void
 pop(Client *c) {
 	detach(c);
@@ -1344,19 +1851,28 @@ propertynotify(XEvent *e) {
 	if((ev->window == root) && (ev->atom == XA_WM_NAME)) {
 		updatestatus();
 		return;
-	} else if(ev->state == PropertyDelete)
-		return; /* ignore */
+	}
 
 	if ((c = wintoclient(ev->window)) == NULL)
 		return;
+	/* properties kept in the client are cleared by their update functions */
+	if(ev->state == PropertyDelete
+	&& ev->atom != XA_WM_TRANSIENT_FOR && ev->atom != XA_WM_HINTS
+	&& ev->atom != wmatom[WMProtocols] && ev->atom != netatom[NetWMState]
+	&& ev->atom != netatom[NetWMSyncRequestCounter])
+		return; /* ignore */
 
 	switch(ev->atom) {
 	default: break;
 	case XA_WM_TRANSIENT_FOR:
-		if(!c->isfloating && (XGetTransientForHint(dpy, c->win, &trans)) &&
-			(c->isfloating = (wintoclient(trans)) != NULL))
+		c->transientfor = XGetTransientForHint(dpy, c->win, &trans) ? trans : None;
+		if(!c->isfloating && c->transientfor != None &&
+			(c->isfloating = (wintoclient(c->transientfor)) != NULL))
 			arrange(c->mon);
 		break;
+	case XA_WM_CLASS:
+		updateclass(c);
+		break;
 	case XA_WM_NORMAL_HINTS:
 		updatesizehints(c);
 		break;
@@ -1367,11 +1883,19 @@ propertynotify(XEvent *e) {
 	}
 	if(ev->atom == XA_WM_NAME || ev->atom == netatom[NetWMName]) {
 		updatetitle(c);
+		if(rule_hastitles())
+			reapplyrules(c);
 		if(c == c->mon->sel)
 			drawbar(c->mon);
 	}
 	if(ev->atom == netatom[NetWMWindowType])
 		updatewindowtype(c);
+	else if(ev->atom == wmatom[WMProtocols])
+		updateprotocols(c);
+	else if(ev->atom == netatom[NetWMState])
+		c->winstate = getatomprop(c, netatom[NetWMState]);
+	else if(ev->atom == netatom[NetWMSyncRequestCounter])
+		updatesync(c);
 }
 
 void
@@ -1395,18 +1919,70 @@ pushdown(const Arg *arg) {
 	arrange(selmon);
 }
 
+/* Called from the event loop once SIGCHLD has fired */
+void
+reapchildren(void) {
+	char buf[64];
+	int status;
+	pid_t pid;
+
+	while(read(chldpipe[0], buf, sizeof buf) > 0);
+	while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		launch_exited(pid, status);
+}
+
+/* Applies the rules a client matches since its title changed. Rules it no
+ * longer matches are not undone. */
+void
+reapplyrules(Client *c) {
+	RuleSet old = c->rules;
+	const Rule *r;
+	Monitor *m, *mon = NULL;
+	unsigned int ruletags = 0;
+	Bool matched = False;
+	int i;
+
+	rule_match(c->class, c->classhash, c->instance, c->name, &c->rules);
+	for(i = rule_next(&c->rules, 0); i != -1; i = rule_next(&c->rules, i + 1)) {
+		if(rule_next(&old, i) == i)
+			continue;
+		r = rule_get(i);
+		matched = True;
+		c->isfloating = r->isfloating;
+		ruletags |= r->tags;
+		for(m = mons; m && m->num != r->monitor; m = m->next);
+		if(m)
+			mon = m;
+	}
+	if(!matched)
+		return;
+	batchbegin();
+	if(mon && mon != c->mon)
+		sendmon(c, mon);
+	if(ruletags & TAGMASK)
+		settags(c, ruletags & TAGMASK);
+	focus(NULL);
+	arrange(c->mon);
+	batchend();
+}
+
 Monitor *
 recttomon(int x, int y, int w, int h) {
-	Monitor *m, *r = selmon;
-	int a, area = 0;
+	Monitor *m;
 
-	for(m = mons; m; m = m->next) {
-		if((a = INTERSECT(x, y, w, h, m)) > area) {
-			area = a;
-			r = m;
-		}
-	}
-	return r;
+	return (m = geom_rect(x, y, w, h)) ? m : selmon;
+}
+
+/* Drops all key grabs, the next grabkeys() grabs every binding again */
+void
+releasekeys(void) {
+	unsigned int i;
+	Binding *b;
+
+	XUngrabKey(dpy, AnyKey, AnyModifier, root);
+	for(i = 0; i < LENGTH(bindings); i++)
+		for(b = bindings[i]; b; b = b->next)
+			b->grabbed = 0;
 }
 
 void
@@ -1422,12 +1998,69 @@ removesystrayicon(Client *i) {
 }
 
 
+/* Drops the layouts added at run time, monitors using them fall back to
+ * the first layout */
+void
+resetlayouts(void) {
+	Monitor *m;
+
+	layout_reset();
+	for(m = mons; m; m = m->next) {
+		if(!layout_get(m->lt[0]))
+			m->lt[0] = 0;
+		if(!layout_get(m->lt[1]))
+			m->lt[1] = 0;
+		strncpy(m->ltsymbol, layout_get(m->lt[m->sellt])->symbol, sizeof m->ltsymbol - 1);
+	}
+	arrange(NULL);
+}
+
+/* Drops the rules added at run time, keeping those from config.h */
+void
+resetrules(void) {
+	rule_truncate(NRULES);
+}
+
 void
 resize(Client *c, int x, int y, int w, int h, Bool interact) {
 	if(applysizehints(c, &x, &y, &w, &h, interact))
 		resizeclient(c, x, y, w, h);
 }
 
+/* The refresh rate of the fastest CRTC showing m, 60 if unknown */
+int
+refreshrate(Monitor *m) {
+#ifdef XRANDR
+	XRRScreenResources *res;
+	XRRCrtcInfo *crtc;
+	XRRModeInfo *mode;
+	int i, j;
+
+	if(m->refresh || randrbase == -1 || !(res = XRRGetScreenResourcesCurrent(dpy, root)))
+		return m->refresh ? m->refresh : 60;
+	for(i = 0; i < res->ncrtc; i++) {
+		if(!(crtc = XRRGetCrtcInfo(dpy, res, res->crtcs[i])))
+			continue;
+		if(crtc->mode != None
+		&& crtc->x >= m->mx && crtc->x < m->mx + m->mw
+		&& crtc->y >= m->my && crtc->y < m->my + m->mh)
+			for(j = 0; j < res->nmode; j++) {
+				mode = &res->modes[j];
+				if(mode->id == crtc->mode && mode->hTotal && mode->vTotal)
+					m->refresh = MAX(m->refresh, (int)((double)mode->dotClock
+					                 / ((double)mode->hTotal * mode->vTotal) + 0.5));
+			}
+		XRRFreeCrtcInfo(crtc);
+	}
+	XRRFreeScreenResources(res);
+	if(!m->refresh)
+		m->refresh = 60;
+	return m->refresh;
+#else
+	return 60;
+#endif /* XRANDR */
+}
+
 void
 resizebarwin(Monitor *m) {
 	unsigned int w = m->ww;
@@ -1438,29 +2071,26 @@ resizebarwin(Monitor *m) {
 
 void
 resizeclient(Client *c, int x, int y, int w, int h) {
-	XWindowChanges wc;
-
-	c->oldx = c->x; c->x = wc.x = x;
-	c->oldy = c->y; c->y = wc.y = y;
-	c->oldw = c->w; c->w = wc.width = w;
-	c->oldh = c->h; c->h = wc.height = h;
-	wc.border_width = c->bw;
-
-	wc.width = MAX(2 * c->bw + 1, wc.width);
-	wc.height = MAX(2 * c->bw + 1, wc.height);
-
-	XConfigureWindow(dpy, c->win, CWX|CWY|CWWidth|CWHeight|CWBorderWidth, &wc);
-	configure(c);
-	XSync(dpy, False);
+	c->oldx = c->x; c->x = x;
+	c->oldy = c->y; c->y = y;
+	c->oldw = c->w; c->w = w;
+	c->oldh = c->h; c->h = h;
+	if(c->syncsent) { /* still repainting, it gets the latest geometry once done */
+		c->syncdirty = True;
+		return;
+	}
+	sendgeometry(c);
 }
 
 void
 resizemouse(const Arg *arg) {
-	int ocx, ocy, nw, nh;
+	int px, py, ocx, ocy, nx, ny, nw, nh, o[4];
+	Bool moving, drawn = False;
+	double last = 0, frame;
 	Client *c;
 	Monitor *m;
+	GC gc = NULL;
 	XEvent ev;
-	Time lasttime = 0;
 
 	if(!(c = selmon->sel))
 		return;
@@ -1473,34 +2103,42 @@ resizemouse(const Arg *arg) {
 	                None, cursor[CurResize]->cursor, CurrentTime) != GrabSuccess)
 		return;
 	XWarpPointer(dpy, None, c->win, 0, 0, 0, 0, c->w + c->bw - 1, c->h + c->bw - 1);
+	frame = 1000.0 / refreshrate(selmon);
+	if(outlinedrag) {
+		batchbegin(); /* no arrange may paint beneath the outline */
+		gc = outlinebegin();
+	}
 	do {
-		XMaskEvent(dpy, MOUSEMASK|ExposureMask|SubstructureRedirectMask, &ev);
-		switch(ev.type) {
-		case ConfigureRequest:
-		case Expose:
-		case MapRequest:
-			handler[ev.type](&ev);
-			break;
-		case MotionNotify:
-			if ((ev.xmotion.time - lasttime) <= (1000 / 60))
-				continue;
-			lasttime = ev.xmotion.time;
-
-			nw = MAX(ev.xmotion.x - ocx - 2 * c->bw + 1, 1);
-			nh = MAX(ev.xmotion.y - ocy - 2 * c->bw + 1, 1);
-			if(c->mon->wx + nw >= selmon->wx
-			   && c->mon->wx + nw <= selmon->wx + selmon->ww
-			   && c->mon->wy + nh >= selmon->wy
-			   && c->mon->wy + nh <= selmon->wy + selmon->wh) {
-				if(!c->isfloating
-				   && (abs(nw - c->w) > snap || abs(nh - c->h) > snap))
-					togglefloating(NULL);
-			}
-			if(c->isfloating)
-				resize(c, c->x, c->y, nw, nh, True);
-			break;
+		moving = dragmotion(&px, &py, &last, frame);
+		if(drawn)
+			drawoutline(gc, o[0], o[1], o[2], o[3]);
+		drawn = False;
+		nw = MAX(px - ocx - 2 * c->bw + 1, 1);
+		nh = MAX(py - ocy - 2 * c->bw + 1, 1);
+		if(c->mon->wx + nw >= selmon->wx
+		   && c->mon->wx + nw <= selmon->wx + selmon->ww
+		   && c->mon->wy + nh >= selmon->wy
+		   && c->mon->wy + nh <= selmon->wy + selmon->wh) {
+			if(!c->isfloating
+			   && (abs(nw - c->w) > snap || abs(nh - c->h) > snap))
+				togglefloating(NULL);
 		}
-	} while(ev.type != ButtonRelease);
+		if(!c->isfloating)
+			continue;
+		if(gc && moving) {
+			nx = c->x;
+			ny = c->y;
+			applysizehints(c, &nx, &ny, &nw, &nh, True);
+			o[0] = nx; o[1] = ny; o[2] = nw + 2 * c->bw; o[3] = nh + 2 * c->bw;
+			drawoutline(gc, o[0], o[1], o[2], o[3]);
+			drawn = True;
+		} else
+			resize(c, c->x, c->y, nw, nh, True);
+	} while(moving);
+	if(gc) {
+		outlineend(gc);
+		batchend();
+	}
 	XWarpPointer(dpy, None, c->win, 0, 0, 0, 0, c->w + c->bw - 1, c->h + c->bw - 1);
 	XUngrabPointer(dpy, CurrentTime);
 	while(XCheckMaskEvent(dpy, EnterWindowMask, &ev));
@@ -1549,11 +2187,58 @@ restack(Monitor *m) {
 void
 run(void) {
 	XEvent ev;
+	struct pollfd pfd[4];
+	int n, t, timeout;
+
+	pfd[0].fd = ConnectionNumber(dpy);
+	pfd[0].events = POLLIN;
+	pfd[1].events = POLLIN;
+	pfd[2].events = POLLIN;
+	pfd[3].fd = chldpipe[0];
+	pfd[3].events = POLLIN;
+
 	/* main event loop */
 	XSync(dpy, False);
-	while(running && !XNextEvent(dpy, &ev)) {
-		if(handler[ev.type])
-			handler[ev.type](&ev); /* call handler */
+	while(running) {
+		while(running && XPending(dpy)) {
+			XNextEvent(dpy, &ev);
+			if(ev.type < LASTEvent && handler[ev.type])
+				handler[ev.type](&ev); /* call handler */
+#ifdef XRANDR
+			else if(randrbase != -1 && (ev.type == randrbase + RRScreenChangeNotify
+			                            || ev.type == randrbase + RRNotify)) {
+				XRRUpdateConfiguration(&ev);
+				geompending = True;
+			}
+#endif /* XRANDR */
+#ifdef XSYNC
+			else if(syncbase != -1 && ev.type == syncbase + XSyncAlarmNotify)
+				syncnotify(&ev);
+#endif /* XSYNC */
+		}
+		/* monitor changes come in bursts, they are applied once */
+		if(geompending)
+			geomchanged();
+		/* Lua timers and deferred callbacks run between event batches */
+		if(l_dispatch())
+			drawbar(selmon);
+		if(!running || XPending(dpy))
+			continue;
+		/* garbage is collected in small steps while there's nothing to do */
+		if(l_collect())
+			continue;
+		pfd[1].fd = l_workerfd(); /* results of Lua workers, -1 if none */
+		pfd[2].fd = launch_fd();  /* exits reported by the launcher */
+		timeout = l_timeout();
+		if((t = synctimeout()) != -1 && (timeout == -1 || t < timeout))
+			timeout = t;
+		if((n = poll(pfd, LENGTH(pfd), timeout)) == -1 && errno != EINTR)
+			err(1, "poll");
+		syncexpire();
+		if(n > 0 && pfd[2].revents)
+			launch_dispatch();
+		if(n > 0 && pfd[3].revents)
+			reapchildren();
 	}
 }
 
@@ -1593,9 +2278,9 @@ sendmon(Client *c, Monitor *m) {
 	detach(c);
 	detachstack(c);
 	c->mon = m;
-	c->tags = m->tagset[m->seltags]; /* assign tags of target monitor */
+	settags(c, m->tagset[m->seltags]); /* assign tags of target monitor */
 	if (c->tags == 0)
-		c->tags = ~0;
+		settags(c, ~0);
 	attach(c);
 	attachstack(c);
 	focus(NULL);
@@ -1610,27 +2295,18 @@ setclientstate(Client *c, long state) {
 	                PropModeReplace, (unsigned char *)data, 2);
 }
 
-Bool
+/* WM_PROTOCOLS messages must only be sent if the client supports them, see
+ * Client.protocols */
+void
 sendevent(Window w, Atom proto, int mask, long d0, long d1, long d2, long d3, long d4) {
-	int n;
-	Atom *protocols, mt;
-	Bool exists = False;
+	Atom mt;
 	XEvent ev;
 
-	if(proto == wmatom[WMTakeFocus] || proto == wmatom[WMDelete]) {
+	if(proto == wmatom[WMTakeFocus] || proto == wmatom[WMDelete]
+	|| proto == netatom[NetWMSyncRequest])
 		mt = wmatom[WMProtocols];
-		if(XGetWMProtocols(dpy, w, &protocols, &n)) {
-			while(!exists && n--)
-				exists = protocols[n] == proto;
-			XFree(protocols);
-		}
-	} else {
-		exists = True;
+	else
 		mt = proto;
-	}
-
-	if (!exists)
-		return False;
 
 	ev.type = ClientMessage;
 	ev.xclient.window = w;
@@ -1642,8 +2318,53 @@ sendevent(Window w, Atom proto, int mask, long d0, long d1, long d2, long d3, lo
 	ev.xclient.data.l[3] = d3;
 	ev.xclient.data.l[4] = d4;
 	XSendEvent(dpy, w, False, mask, &ev);
+}
 
-	return True;
+/* Configures what changed about the window of c since it was last
+ * configured. The server reports changes with a real ConfigureNotify, only
+ * if nothing changed the client is sent a synthetic one. If c supports
+ * _NET_WM_SYNC_REQUEST and its size changes, it's asked to report when it
+ * has repainted. Until then resizeclient() holds back further geometry. */
+void
+sendgeometry(Client *c) {
+	XWindowChanges wc;
+	unsigned int mask = 0;
+#ifdef XSYNC
+	XSyncAlarmAttributes aa;
+#endif /* XSYNC */
+
+	wc.x = c->ishidden ? WIDTH(c) * -2 : c->x;
+	wc.y = c->y;
+	wc.width = MAX(2 * c->bw + 1, c->w);
+	wc.height = MAX(2 * c->bw + 1, c->h);
+	wc.border_width = c->bw;
+	if(wc.x != c->sent.x)
+		mask |= CWX;
+	if(wc.y != c->sent.y)
+		mask |= CWY;
+	if(wc.width != c->sent.width)
+		mask |= CWWidth;
+	if(wc.height != c->sent.height)
+		mask |= CWHeight;
+	if(wc.border_width != c->sent.border_width)
+		mask |= CWBorderWidth;
+	if(!mask) {
+		configure(c);
+		return;
+	}
+#ifdef XSYNC
+	if(c->syncalarm && !c->syncsent && (mask & (CWWidth|CWHeight))) {
+		c->syncvalue++;
+		XSyncIntsToValue(&aa.trigger.wait_value, c->syncvalue & 0xffffffff, c->syncvalue >> 32);
+		XSyncChangeAlarm(dpy, c->syncalarm, XSyncCAValue, &aa);
+		sendevent(c->win, netatom[NetWMSyncRequest], NoEventMask, netatom[NetWMSyncRequest],
+		          CurrentTime, c->syncvalue & 0xffffffff, c->syncvalue >> 32, 0);
+		c->syncsent = now();
+		syncwaiting++;
+	}
+#endif /* XSYNC */
+	c->sent = wc;
+	XConfigureWindow(dpy, c->win, mask, &wc);
 }
 
 void
@@ -1654,7 +2375,8 @@ setfocus(Client *c) {
  		                XA_WINDOW, 32, PropModeReplace,
  		                (unsigned char *) &(c->win), 1);
 	}
-	sendevent(c->win, wmatom[WMTakeFocus], NoEventMask, wmatom[WMTakeFocus], CurrentTime, 0, 0, 0);
+	if(c->protocols & ProtoTakeFocus)
+		sendevent(c->win, wmatom[WMTakeFocus], NoEventMask, wmatom[WMTakeFocus], CurrentTime, 0, 0, 0);
 }
 
 void
@@ -1662,6 +2384,7 @@ setfullscreen(Client *c, Bool fullscreen) {
 	if(fullscreen) {
 		XChangeProperty(dpy, c->win, netatom[NetWMState], XA_ATOM, 32,
 		                PropModeReplace, (unsigned char*)&netatom[NetWMFullscreen], 1);
+		c->winstate = netatom[NetWMFullscreen];
 		c->isfullscreen = True;
 		c->oldstate = c->isfloating;
 		c->oldbw = c->bw;
@@ -1672,6 +2395,7 @@ setfullscreen(Client *c, Bool fullscreen) {
 	} else {
 		XChangeProperty(dpy, c->win, netatom[NetWMState], XA_ATOM, 32,
 		                PropModeReplace, (unsigned char*)0, 0);
+		c->winstate = None;
 		c->isfullscreen = False;
 		c->isfloating = c->oldstate;
 		c->bw = c->oldbw;
@@ -1684,6 +2408,17 @@ setfullscreen(Client *c, Bool fullscreen) {
 	}
 }
 
+/* Selects layout on m, -1 switches back to the previous one */
+void
+setlayout(Monitor *m, int layout) {
+	if(layout == -1 || layout != m->lt[m->sellt])
+		m->sellt ^= 1;
+	if(layout != -1 && layout_get(layout))
+		m->lt[m->sellt] = layout;
+	strncpy(m->ltsymbol, layout_get(m->lt[m->sellt])->symbol, sizeof m->ltsymbol - 1);
+	arrange(m);
+}
+
 /* arg > 1.0 will set mfact absolutly */
 void
 setmfact(const Arg *arg) {
@@ -1698,12 +2433,43 @@ setmfact(const Arg *arg) {
 	arrange(selmon);
 }
 
+/* Keeps the tag lists in step, tags of managed clients only change here */
+void
+settags(Client *c, unsigned int newtags) {
+	Client **tc;
+	unsigned int i;
+
+	for(i = 0; i < LENGTH(tags); i++) {
+		if(!(c->tags & 1 << i) == !(newtags & 1 << i))
+			continue;
+		if(newtags & 1 << i) {
+			c->tagnext[i] = tagindex[i];
+			tagindex[i] = c;
+		} else {
+			for(tc = &tagindex[i]; *tc != c; tc = &(*tc)->tagnext[i]);
+			*tc = c->tagnext[i];
+		}
+	}
+	c->tags = newtags;
+}
+
 void
 setup(void) {
 	XSetWindowAttributes wa;
+	unsigned int i;
 
 	/* clean up any zombies immediately */
+	if(pipe(chldpipe) == -1)
+		err(1, "pipe");
+	fcntl(chldpipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(chldpipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(chldpipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(chldpipe[1], F_SETFD, FD_CLOEXEC);
 	sigchld(0);
+	reapchildren();
+
+	/* children must not inherit the X connection */
+	fcntl(ConnectionNumber(dpy), F_SETFD, FD_CLOEXEC);
 
 	/* init screen */
 	screen = DefaultScreen(dpy);
@@ -1714,6 +2480,12 @@ setup(void) {
 	bh = fnt->h;
 	drw = drw_create(dpy, screen, root, sw, sh);
 	drw_setfont(drw, fnt);
+#ifdef XRANDR
+	initrandr();
+#endif /* XRANDR */
+#ifdef XSYNC
+	initsync();
+#endif /* XSYNC */
 	updategeom();
 	/* init atoms */
 	wmatom[WMProtocols] = XInternAtom(dpy, "WM_PROTOCOLS", False);
@@ -1731,6 +2503,10 @@ setup(void) {
 	netatom[NetWMWindowType] = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE", False);
 	netatom[NetWMWindowTypeDialog] = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_DIALOG", False);
 	netatom[NetClientList] = XInternAtom(dpy, "_NET_CLIENT_LIST", False);
+	netatom[NetWMPid] = XInternAtom(dpy, "_NET_WM_PID", False);
+	netatom[NetStartupId] = XInternAtom(dpy, "_NET_STARTUP_ID", False);
+	netatom[NetWMSyncRequest] = XInternAtom(dpy, "_NET_WM_SYNC_REQUEST", False);
+	netatom[NetWMSyncRequestCounter] = XInternAtom(dpy, "_NET_WM_SYNC_REQUEST_COUNTER", False);
 	xatom[Manager] = XInternAtom(dpy, "MANAGER", False);
 	xatom[Xembed] = XInternAtom(dpy, "_XEMBED", False);
 	xatom[XembedInfo] = XInternAtom(dpy, "_XEMBED_INFO", False);
@@ -1753,11 +2529,18 @@ setup(void) {
 	XDeleteProperty(dpy, root, netatom[NetClientList]);
 	/* select for events */
 	wa.cursor = cursor[CurNormal]->cursor;
-	wa.event_mask = SubstructureRedirectMask|SubstructureNotifyMask|ButtonPressMask|PointerMotionMask
+	wa.event_mask = SubstructureRedirectMask|SubstructureNotifyMask|ButtonPressMask
 	                |EnterWindowMask|LeaveWindowMask|StructureNotifyMask|PropertyChangeMask;
+	if(!backdrops) /* otherwise entering a backdrop tells the monitor changed */
+		wa.event_mask |= PointerMotionMask;
 	XChangeWindowAttributes(dpy, root, CWEventMask|CWCursor, &wa);
 	XSelectInput(dpy, root, wa.event_mask);
+	updatenumlockmask();
+	initbindings();
 	grabkeys();
+	for(i = 0; i < NRULES; i++)
+		if(rule_add(&rules[i]) == -1)
+			errx(1, "too many rules");
 	focus(NULL);
 
 	l_init();
@@ -1772,53 +2555,150 @@ showhide(Client *c) {
 	if(!c)
 		return;
 	if(ISVISIBLE(c)) { /* show clients top down */
-		XMoveWindow(dpy, c->win, c->x, c->y);
+		if(c->ishidden) {
+			c->ishidden = False;
+			sendgeometry(c);
+		}
 		if(c->isfloating && !c->isfullscreen)
 			resize(c, c->x, c->y, c->w, c->h, False);
 		showhide(c->snext);
 	} else { /* hide clients bottom up */
 		showhide(c->snext);
-		XMoveWindow(dpy, c->win, WIDTH(c) * -2, c->y);
+		if(!c->ishidden) {
+			c->ishidden = True;
+			sendgeometry(c);
+		}
 	}
 }
 
 void
 sigchld(int unused) {
+	int e = errno;
+
 	if(signal(SIGCHLD, sigchld) == SIG_ERR)
 		errx(1, "Can't install SIGCHLD handler");
-	while(0 < waitpid(-1, NULL, WNOHANG));
+	/* children are reaped by the event loop, see reapchildren */
+	while(write(chldpipe[1], "", 1) == -1 && errno == EINTR);
+	errno = e;
+}
+
+/* c has repainted or took too long */
+void
+syncdone(Client *c) {
+	c->syncsent = 0;
+	syncwaiting--;
+	if(c->syncdirty) {
+		c->syncdirty = False;
+		sendgeometry(c);
+	}
+}
+
+void
+syncexpire(void) {
+	Monitor *m;
+	Client *c;
+	double t;
+
+	if(!syncwaiting)
+		return;
+	t = now();
+	for(m = mons; m; m = m->next)
+		for(c = m->clients; c; c = c->next)
+			if(c->syncsent && t - c->syncsent >= SYNCTIMEOUT)
+				syncdone(c);
+}
+
+#ifdef XSYNC
+void
+initsync(void) {
+	int major, minor;
+
+	if(!XSyncQueryExtension(dpy, &syncbase, &syncerror)
+	|| !XSyncInitialize(dpy, &major, &minor))
+		syncbase = -1;
+}
+
+void
+syncnotify(XEvent *e) {
+	XSyncAlarmNotifyEvent *ev = (XSyncAlarmNotifyEvent *)e;
+	Monitor *m;
+	Client *c;
+
+	for(m = mons; m; m = m->next)
+		for(c = m->clients; c; c = c->next)
+			if(c->syncalarm == ev->alarm) {
+				if(c->syncsent
+				&& ((long long)XSyncValueHigh32(ev->counter_value) << 32
+				    | XSyncValueLow32(ev->counter_value)) >= c->syncvalue)
+					syncdone(c);
+				return;
+			}
+}
+#endif /* XSYNC */
+
+/* ms until the first client waited for times out, -1 if none */
+int
+synctimeout(void) {
+	Monitor *m;
+	Client *c;
+	double t, first = -1;
+
+	if(!syncwaiting)
+		return -1;
+	for(m = mons; m; m = m->next)
+		for(c = m->clients; c; c = c->next)
+			if(c->syncsent && (first == -1 || c->syncsent < first))
+				first = c->syncsent;
+	if(first == -1)
+		return -1;
+	return (t = first + SYNCTIMEOUT - now()) > 0 ? (int)t + 1 : 0;
 }
 
 void
 spawn(const Arg *arg) {
-	switch (fork()) {
-		case -1:
-			perror("fork");
-			break;
-		case 0:
-			if(dpy)
-				close(ConnectionNumber(dpy));
-			setsid();
-			execvp(((char **)arg->v)[0], (char **)arg->v);
-			fprintf(stderr, "dwm: execvp(): %s", ((char **)arg->v)[0]);
-			perror(" failed");
-			exit(EXIT_SUCCESS);
-			break;
-		default:
-			break;
+	if(spawncmd((char *const *)arg->v, NULL, NULL) == -1) {
+		fprintf(stderr, "dwm: spawn(): %s", ((char **)arg->v)[0]);
+		perror(" failed");
 	}
 }
 
+/* Starts a program and remembers where, so its windows end up there */
+pid_t
+spawncmd(char *const argv[], char *const env[], const char *cwd) {
+	LaunchProc *p;
+
+	if(!(p = launch_spawn(argv, env, cwd)))
+		return -1;
+	p->mon = selmon->num;
+	p->tags = selmon->tagset[selmon->seltags];
+	return p->pid;
+}
+
+/* FNV-1a, used to compare window classes without strcmp */
+unsigned int
+strhash(const char *s) {
+	unsigned int h = 2166136261u;
+
+	while(*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
 void
 tag(Client *c, unsigned int t) {
 	if (!c || !(t & TAGMASK))
 		return;
 
-	c->tags = t & TAGMASK;
+	settags(c, t & TAGMASK);
 	focus(NULL);
 	arrange(selmon);
 }
 
+Client *
+tagclients(unsigned int i) {
+	return i < LENGTH(tags) ? tagindex[i] : NULL;
+}
+
 void
 tagmon(const Arg *arg) {
 	if(!selmon->sel || !mons->next)
@@ -1846,7 +2726,7 @@ toggletag(Client *c, unsigned int t) {
 	if(!c)
 		return;
 	newtags = c->tags ^ (t & TAGMASK);
-	c->tags = newtags;
+	settags(c, newtags);
 	focus(NULL);
 	arrange(selmon);
 }
@@ -1860,6 +2740,21 @@ toggleview(unsigned int t) {
 	arrange(selmon);
 }
 
+void
+unbindkeys(void) {
+	unsigned int i;
+	Binding *b;
+
+	for(i = 0; i < LENGTH(bindings); i++) {
+		for(b = bindings[i]; b; b = b->next) {
+			l_unref(b->ref);
+			l_unref(b->nameref);
+			b->ref = b->nameref = 0;
+		}
+	}
+	grabkeys();
+}
+
 void
 unfocus(Client *c, Bool setfocus) {
 	if(!c)
@@ -1883,6 +2778,14 @@ unmanage(Client *c, Bool destroyed) {
 	/* The server grab construct avoids race conditions. */
 	detach(c);
 	detachstack(c);
+	detachclass(c);
+	settags(c, 0);
+	if(c->syncsent)
+		syncwaiting--;
+#ifdef XSYNC
+	if(c->syncalarm)
+		XSyncDestroyAlarm(dpy, c->syncalarm);
+#endif /* XSYNC */
 	if(!destroyed) {
 		wc.border_width = c->oldbw;
 		XGrabServer(dpy);
@@ -1894,6 +2797,7 @@ unmanage(Client *c, Bool destroyed) {
 		XSetErrorHandler(xerror);
 		XUngrabServer(dpy);
 	}
+	l_client_unmanage(c);
 	free(c);
 	focus(NULL);
 	updateclientlist();
@@ -1927,7 +2831,21 @@ updatebars(void) {
 		.background_pixmap = ParentRelative,
 		.event_mask = ButtonPressMask|ExposureMask
 	};
+	XSetWindowAttributes bwa = {
+		.override_redirect = True,
+		.event_mask = EnterWindowMask
+	};
 	for(m = mons; m; m = m->next) {
+		/* The pointer enters the backdrop of a monitor when it crosses over
+		 * from another one, there's no event while it moves inside. Clicks
+		 * propagate to the root window. */
+		if(backdrops && !m->backdrop) {
+			m->backdrop = XCreateWindow(dpy, root, m->mx, m->my, m->mw, m->mh, 0, 0,
+			                            InputOnly, CopyFromParent,
+			                            CWOverrideRedirect|CWEventMask, &bwa);
+			XMapWindow(dpy, m->backdrop);
+			XLowerWindow(dpy, m->backdrop);
+		}
 		if (m->barwin)
 			continue;
 		w = m->ww;
@@ -1948,6 +2866,28 @@ updatebarpos(Monitor *m) {
 	m->wh -= bh;
 	m->by = m->topbar ? m->wy : m->wy + m->wh;
 	m->wy = m->topbar ? m->wy + bh : m->wy;
+	if(m->backdrop)
+		XMoveResizeWindow(dpy, m->backdrop, m->mx, m->my, m->mw, m->mh);
+	geom_invalidate();
+}
+
+void
+updateclass(Client *c) {
+	XClassHint ch = { NULL, NULL };
+
+	XGetClassHint(dpy, c->win, &ch);
+	detachclass(c);
+	free(c->class);
+	free(c->instance);
+	c->class = strdup(ch.res_class ? ch.res_class : broken);
+	c->classhash = strhash(c->class);
+	c->instance = strdup(ch.res_name ? ch.res_name : broken);
+	attachclass(c);
+	if(ch.res_class)
+		XFree(ch.res_class);
+	if(ch.res_name)
+		XFree(ch.res_name);
+	l_client_changed(c);
 }
 
 void
@@ -1967,6 +2907,10 @@ Bool
 updategeom(void) {
 	Bool dirty = False;
 
+#ifdef XRANDR
+	if(randrbase != -1)
+		return updaterandr();
+#endif /* XRANDR */
 #ifdef XINERAMA
 	if(XineramaIsActive(dpy)) {
 		int i, j, n, nn;
@@ -1977,8 +2921,7 @@ updategeom(void) {
 
 		for(n = 0, m = mons; m; m = m->next, n++);
 		/* only consider unique geometries as separate screens */
-		if(!(unique = (XineramaScreenInfo *)malloc(sizeof(XineramaScreenInfo) * nn)))
-			errx(1, "fatal: could not malloc() %lu bytes", sizeof(XineramaScreenInfo) * nn);
+		unique = ecalloc(nn, sizeof(XineramaScreenInfo));
 		for(i = 0, j = 0; i < nn; i++)
 			if(isuniquegeom(unique, j, &info[i]))
 				memcpy(&unique[j++], &info[i], sizeof(XineramaScreenInfo));
@@ -2043,18 +2986,43 @@ updategeom(void) {
 	return dirty;
 }
 
-void
+/* Only called at startup and on MappingNotify, returns whether the mask
+ * changed */
+Bool
 updatenumlockmask(void) {
-	unsigned int i, j;
+	unsigned int i, j, old = numlockmask;
+	KeyCode code;
 	XModifierKeymap *modmap;
 
 	numlockmask = 0;
+	code = XKeysymToKeycode(dpy, XK_Num_Lock);
 	modmap = XGetModifierMapping(dpy);
 	for(i = 0; i < 8; i++)
 		for(j = 0; j < modmap->max_keypermod; j++)
-			if(modmap->modifiermap[i * modmap->max_keypermod + j] == XKeysymToKeycode(dpy, XK_Num_Lock))
+			if(code && modmap->modifiermap[i * modmap->max_keypermod + j] == code)
 				numlockmask = (1 << i);
 	XFreeModifiermap(modmap);
+	return numlockmask != old;
+}
+
+void
+updateprotocols(Client *c) {
+	int n;
+	Atom *protocols;
+
+	c->protocols = 0;
+	if(!XGetWMProtocols(dpy, c->win, &protocols, &n))
+		return;
+	while(n--) {
+		if(protocols[n] == wmatom[WMDelete])
+			c->protocols |= ProtoDelete;
+		else if(protocols[n] == wmatom[WMTakeFocus])
+			c->protocols |= ProtoTakeFocus;
+		else if(protocols[n] == netatom[NetWMSyncRequest])
+			c->protocols |= ProtoSyncRequest;
+	}
+	XFree(protocols);
+	updatesync(c);
 }
 
 void
@@ -2102,21 +3070,12 @@ updatesizehints(Client *c) {
 
 void
 updatetitle(Client *c) {
-	XClassHint ch = { NULL, NULL };
-
-	if (c->class)
-		free(c->class);
-	if (c->instance)
-		free(c->instance);
-	XGetClassHint(dpy, c->win, &ch);
-	c->class = strdup(ch.res_class ? ch.res_class : broken);
-	c->instance = strdup(ch.res_name ? ch.res_name : broken);
-
 	if(!gettextprop(c->win, netatom[NetWMName], c->name, sizeof c->name))
 		gettextprop(c->win, XA_WM_NAME, c->name, sizeof c->name);
 
 	if(c->name[0] == '\0') /* hack to mark broken clients */
 		strlcpy(c->name, broken, sizeof(c->name));
+	l_client_changed(c);
 }
 
 void
@@ -2126,6 +3085,49 @@ updatestatus(void) {
 	drawbar(selmon);
 }
 
+/* Sets up the alarm telling when c has repainted after a resize */
+void
+updatesync(Client *c) {
+#ifdef XSYNC
+	XSyncAlarmAttributes aa;
+	XSyncValue v;
+	Atom type;
+	int format;
+	unsigned long n, extra;
+	unsigned char *p = NULL;
+	XID counter = 0;
+
+	if(syncbase != -1 && (c->protocols & ProtoSyncRequest)
+	&& XGetWindowProperty(dpy, c->win, netatom[NetWMSyncRequestCounter], 0L, 1L, False,
+	                      XA_CARDINAL, &type, &format, &n, &extra, &p) == Success && p) {
+		if(n == 1 && format == 32)
+			counter = *(long *)p;
+		XFree(p);
+	}
+	if(counter == c->synccounter)
+		return;
+	if(c->syncalarm) {
+		XSyncDestroyAlarm(dpy, c->syncalarm);
+		c->syncalarm = 0;
+	}
+	if(c->syncsent)
+		syncdone(c);
+	if(!(c->synccounter = counter) || !XSyncQueryCounter(dpy, counter, &v)) {
+		c->synccounter = 0;
+		return;
+	}
+	c->syncvalue = (long long)XSyncValueHigh32(v) << 32 | XSyncValueLow32(v);
+	aa.trigger.counter = counter;
+	aa.trigger.value_type = XSyncAbsolute;
+	aa.trigger.wait_value = v;
+	aa.trigger.test_type = XSyncPositiveComparison;
+	XSyncIntToValue(&aa.delta, 0);
+	aa.events = True;
+	c->syncalarm = XSyncCreateAlarm(dpy, XSyncCACounter|XSyncCAValueType|XSyncCAValue
+	                                     |XSyncCATestType|XSyncCADelta|XSyncCAEvents, &aa);
+#endif /* XSYNC */
+}
+
 void
 updatesystrayicongeom(Client *i, int w, int h) {
 	if (i == NULL)
@@ -2187,8 +3189,7 @@ updatesystray(void) {
 		return;
 	if(!systray) {
 		/* init systray */
-		if(!(systray = (Systray *)calloc(1, sizeof(Systray))))
-			errx(1, "fatal: could not malloc() %lu bytes", sizeof(Systray));
+		systray = ecalloc(1, sizeof(Systray));
 		systray->win = XCreateSimpleWindow(dpy, root, x, selmon->by, w, bh, 0, 0, scheme[SchemeSel].bg->rgb.pixel);
 		wa.event_mask        = ButtonPressMask | ExposureMask;
 		wa.override_redirect = True;
@@ -2233,12 +3234,11 @@ updatesystray(void) {
 
 void
 updatewindowtype(Client *c) {
-	Atom state = getatomprop(c, netatom[NetWMState]);
-	Atom wtype = getatomprop(c, netatom[NetWMWindowType]);
-
-	if(state == netatom[NetWMFullscreen])
+	c->wintype = getatomprop(c, netatom[NetWMWindowType]);
+	/* winstate is read in manage() and on PropertyNotify */
+	if(!c->isfullscreen && c->winstate == netatom[NetWMFullscreen])
 		setfullscreen(c, True);
-	if(wtype == netatom[NetWMWindowTypeDialog])
+	if(c->wintype == netatom[NetWMWindowTypeDialog])
 		c->isfloating = True;
 }
 
@@ -2246,19 +3246,21 @@ void
 updatewmhints(Client *c) {
 	XWMHints *wmh = XGetWMHints(dpy, c->win);
 
-	if (!wmh)
-		return;
+	if(wmh) {
+		c->wmhints = *wmh;
+		XFree(wmh);
+	} else
+		c->wmhints.flags = 0; /* not urgent and focusable, like without hints */
 
-	if(c == selmon->sel && wmh->flags & XUrgencyHint) {
-		wmh->flags &= ~XUrgencyHint;
-		XSetWMHints(dpy, c->win, wmh);
+	if(c == selmon->sel && c->wmhints.flags & XUrgencyHint) {
+		c->wmhints.flags &= ~XUrgencyHint;
+		XSetWMHints(dpy, c->win, &c->wmhints);
 	} else
-		c->isurgent = (wmh->flags & XUrgencyHint) ? True : False;
-	if(wmh->flags & InputHint)
-		c->neverfocus = !wmh->input;
+		c->isurgent = (c->wmhints.flags & XUrgencyHint) ? True : False;
+	if(c->wmhints.flags & InputHint)
+		c->neverfocus = !c->wmhints.input;
 	else
 		c->neverfocus = False;
-	XFree(wmh);
 }
 
 void
@@ -2289,9 +3291,9 @@ wintomon(Window w) {
 	Monitor *m;
 
 	if(w == root && getrootptr(&x, &y))
-		return recttomon(x, y, 1, 1);
+		return (m = geom_point(x, y)) ? m : selmon;
 	for(m = mons; m; m = m->next)
-		if(w == m->barwin)
+		if(w == m->barwin || (m->backdrop && w == m->backdrop))
 			return m;
 	if((c = wintoclient(w)))
 		return c->mon;
@@ -2313,6 +3315,12 @@ wintosystrayicon(Window w) {
  * default error handler, which may call exit.  */
 int
 xerror(Display *dpy, XErrorEvent *ee) {
+#ifdef XSYNC
+	/* counters go away with their clients */
+	if(syncbase != -1 && (ee->error_code == syncerror + XSyncBadCounter
+	                      || ee->error_code == syncerror + XSyncBadAlarm))
+		return 0;
+#endif /* XSYNC */
 	if(ee->error_code == BadWindow
 	|| (ee->request_code == X_SetInputFocus && ee->error_code == BadMatch)
 	|| (ee->request_code == X_PolyText8 && ee->error_code == BadDrawable)
@@ -2360,6 +3368,7 @@ main(int argc, char *argv[]) {
 		errx(1, "usage: dwm [-v]");
 	if(!setlocale(LC_CTYPE, "") || !XSupportsLocale())
 		fputs("warning: no locale support\n", stderr);
+	launch_init();
 	if(!(dpy = XOpenDisplay(NULL)))
 		errx(1, "dwm: cannot open display");
 	checkotherwm();
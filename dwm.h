@@ -1,10 +1,17 @@
 #ifndef _DWM_H
 #define _DWM_H
+#include <sys/types.h>
 #include <X11/keysym.h>
+#include <X11/Xutil.h>
+
+#include "layout.h"
+#include "rule.h"
 
 typedef struct Monitor Monitor;
 typedef struct Client Client;
 
+#define MAXTAGS 31
+
 struct Monitor {
 	char ltsymbol[16];
 	float mfact;
@@ -15,17 +22,24 @@ struct Monitor {
 	int wx, wy, ww, wh;   /* window area  */
 	unsigned int seltags;
 	unsigned int sellt;
+	int lt[2];            /* layout indices, lt[sellt] is in use */
+	LayoutCache lc;
 	unsigned int tagset[2];
 	Bool topbar;
+	Bool dirty;           /* arrange pending until the batch ends */
 	Client *clients;
 	Client *sel;
 	Client *stack;
 	Monitor *next;
 	Window barwin;
+	Window backdrop;      /* InputOnly, below all clients, 0 if unused */
+	Atom name;            /* RandR monitor name, None without RandR */
+	int refresh;          /* Hz, 0 until asked */
 };
 
 struct Client {
 	char *class, *instance;
+	unsigned int classhash;
 	char name[256];
 	float mina, maxa;
 	int x, y, w, h;
@@ -34,8 +48,23 @@ struct Client {
 	int bw, oldbw;
 	unsigned int tags;
 	Bool isfixed, isfloating, isurgent, neverfocus, oldstate, isfullscreen;
+	Bool ishidden;          /* moved off screen by showhide */
+	unsigned int protocols; /* supported WM_PROTOCOLS, see Proto* in dwm.c */
+	XID synccounter, syncalarm; /* _NET_WM_SYNC_REQUEST, 0 if unused */
+	long long syncvalue;    /* last value asked for */
+	double syncsent;        /* when it was asked for, 0 if not waiting */
+	Bool syncdirty;         /* geometry changed while waiting */
+	XWindowChanges sent;    /* geometry last configured */
+	XWMHints wmhints;       /* last WM_HINTS, flags are 0 if there are none */
+	Atom wintype, winstate; /* first atoms of _NET_WM_WINDOW_TYPE and _STATE */
+	Window transientfor;
+	RuleSet rules;          /* rules matched when last evaluated */
+	Bool grabfocused;      /* state the buttons were last grabbed for */
+	unsigned int grabgen;  /* grabgen the buttons were grabbed in, 0 if never */
 	Client *next;
 	Client *snext;
+	Client *classnext;       /* next in the bucket of classclients() */
+	Client *tagnext[MAXTAGS]; /* next in the lists of tagclients() */
 	Monitor *mon;
 	Window win;
 };
@@ -47,17 +76,30 @@ typedef union {
 	const void *v;
 } Arg;
 
-void grabkey(int, KeySym, int);
+void batchbegin(void);
+void batchend(void);
+int bindkey(unsigned int, KeySym, int);
+/* Managed clients whose class hash shares a bucket with hash, linked by
+ * classnext */
+Client *classclients(unsigned int hash);
+/* Managed clients on tag i, linked by tagnext[i] */
+Client *tagclients(unsigned int i);
 
 Monitor *dirtomon(int dir);
 void focusmon(const Arg *arg);
 void focusstack(int);
 void killclient(Client *);
+void resetlayouts(void);
+void resetrules(void);
 void sendmon(Client *c, Monitor *m);
+void setlayout(Monitor *m, int layout);
+pid_t spawncmd(char *const argv[], char *const env[], const char *cwd);
+unsigned int strhash(const char *);
 void tag(Client *, unsigned int);
 void togglefloating(Client *);
 void toggletag(Client *, unsigned int);
 void toggleview(unsigned int);
+void unbindkeys(void);
 void view(unsigned int);
 void zoom(Client *);
 
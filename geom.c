@@ -0,0 +1,195 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * The window areas of all monitors split the screen into a grid: its columns
+ * lie between the sorted distinct left and right edges, its rows between the
+ * top and bottom edges. Every cell lists the monitors covering it, so a
+ * point is found by two binary searches and a rectangle only visits the
+ * cells it overlaps.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "geom.h"
+#include "util.h"
+
+typedef struct {
+	int *edges; /* sorted distinct edges */
+	int n;
+} Axis;
+
+extern Monitor *mons;
+
+static Bool dirty = True;
+static Axis xs, ys;
+static Monitor **monv = NULL; /* monitors by index */
+static long *area = NULL;     /* scratch for geom_rect by monitor, kept zeroed */
+static int *touched = NULL;   /* monitors geom_rect added area to */
+static int *cells = NULL;     /* (xs.n - 1) * (ys.n - 1) + 1 offsets into cellmons */
+static int *cellmons = NULL;  /* monitor indices, in list order per cell */
+static int nmons = 0, cap = 0, cellcap = 0, cellmoncap = 0;
+
+static int
+intcmp(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+static void
+axissort(Axis *a) {
+	int i, j;
+
+	qsort(a->edges, a->n, sizeof(int), intcmp);
+	for(i = j = 0; i < a->n; i++)
+		if(!j || a->edges[j - 1] != a->edges[i])
+			a->edges[j++] = a->edges[i];
+	a->n = j;
+}
+
+/* The cell containing v, -1 if v is outside the axis */
+static int
+axiscell(const Axis *a, int v) {
+	int lo = 0, hi = a->n - 1, mid;
+
+	if(a->n < 2 || v < a->edges[0] || v >= a->edges[a->n - 1])
+		return -1;
+	while(hi - lo > 1) { /* edges[lo] <= v < edges[hi] */
+		mid = (lo + hi) / 2;
+		if(a->edges[mid] <= v)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* The cells overlapped by [v, v + len), returns False if there are none */
+static Bool
+axisrange(const Axis *a, int v, int len, int *first, int *last) {
+	if(a->n < 2 || len <= 0 || v + len <= a->edges[0] || v >= a->edges[a->n - 1])
+		return False;
+	*first = v <= a->edges[0] ? 0 : axiscell(a, v);
+	*last = v + len >= a->edges[a->n - 1] ? a->n - 2 : axiscell(a, v + len - 1);
+	return True;
+}
+
+static void
+rebuild(void) {
+	Monitor *m;
+	int i, j, k, x0, x1, y0, y1, ncells, ncellmons;
+
+	for(nmons = 0, m = mons; m; m = m->next, nmons++);
+	if(nmons > cap) {
+		cap = nmons;
+		monv = erealloc(monv, cap * sizeof(Monitor *));
+		area = erealloc(area, cap * sizeof(long));
+		touched = erealloc(touched, cap * sizeof(int));
+		xs.edges = erealloc(xs.edges, 2 * cap * sizeof(int));
+		ys.edges = erealloc(ys.edges, 2 * cap * sizeof(int));
+	}
+	xs.n = ys.n = 0;
+	memset(area, 0, nmons * sizeof(long));
+	for(i = 0, m = mons; m; m = m->next, i++) {
+		monv[i] = m;
+		if(m->ww <= 0 || m->wh <= 0)
+			continue;
+		xs.edges[xs.n++] = m->wx;
+		xs.edges[xs.n++] = m->wx + m->ww;
+		ys.edges[ys.n++] = m->wy;
+		ys.edges[ys.n++] = m->wy + m->wh;
+	}
+	axissort(&xs);
+	axissort(&ys);
+
+	/* count the monitors of every cell, then turn the counts into offsets */
+	ncells = xs.n > 1 && ys.n > 1 ? (xs.n - 1) * (ys.n - 1) : 0;
+	if(ncells + 1 > cellcap) {
+		cellcap = ncells + 1;
+		cells = erealloc(cells, cellcap * sizeof(int));
+	}
+	memset(cells, 0, (ncells + 1) * sizeof(int));
+	for(m = mons; m; m = m->next)
+		if(axisrange(&xs, m->wx, m->ww, &x0, &x1) && axisrange(&ys, m->wy, m->wh, &y0, &y1))
+			for(j = y0; j <= y1; j++)
+				for(k = x0; k <= x1; k++)
+					cells[j * (xs.n - 1) + k + 1]++;
+	for(i = 0; i < ncells; i++)
+		cells[i + 1] += cells[i];
+	if((ncellmons = cells[ncells]) > cellmoncap) {
+		cellmoncap = ncellmons;
+		cellmons = erealloc(cellmons, cellmoncap * sizeof(int));
+	}
+	/* fill in list order, cells[c] ends up as the start of cell c */
+	for(i = 0, m = mons; m; m = m->next, i++)
+		if(axisrange(&xs, m->wx, m->ww, &x0, &x1) && axisrange(&ys, m->wy, m->wh, &y0, &y1))
+			for(j = y0; j <= y1; j++)
+				for(k = x0; k <= x1; k++)
+					cellmons[cells[j * (xs.n - 1) + k]++] = i;
+	memmove(cells + 1, cells, ncells * sizeof(int));
+	cells[0] = 0;
+	dirty = False;
+}
+
+void
+geom_invalidate(void) {
+	dirty = True;
+}
+
+Monitor *
+geom_point(int x, int y) {
+	int i, j, c;
+
+	if(dirty)
+		rebuild();
+	if((i = axiscell(&xs, x)) == -1 || (j = axiscell(&ys, y)) == -1)
+		return NULL;
+	c = j * (xs.n - 1) + i;
+	return cells[c] < cells[c + 1] ? monv[cellmons[cells[c]]] : NULL;
+}
+
+Monitor *
+geom_rect(int x, int y, int w, int h) {
+	int i, j, k, c, m, x0, x1, y0, y1, ntouched = 0, best = -1;
+	long a;
+
+	if(dirty)
+		rebuild();
+	if(!axisrange(&xs, x, w, &x0, &x1) || !axisrange(&ys, y, h, &y0, &y1))
+		return NULL;
+	/* within one cell, every monitor covering it overlaps the same area */
+	if(x0 == x1 && y0 == y1) {
+		c = y0 * (xs.n - 1) + x0;
+		return cells[c] < cells[c + 1] ? monv[cellmons[cells[c]]] : NULL;
+	}
+	for(j = y0; j <= y1; j++)
+		for(i = x0; i <= x1; i++) {
+			c = j * (xs.n - 1) + i;
+			a = (long)(MIN(x + w, xs.edges[i + 1]) - MAX(x, xs.edges[i]))
+			  * (MIN(y + h, ys.edges[j + 1]) - MAX(y, ys.edges[j]));
+			for(k = cells[c]; k < cells[c + 1]; k++) {
+				if(!area[m = cellmons[k]])
+					touched[ntouched++] = m;
+				area[m] += a;
+			}
+		}
+	for(i = 0; i < ntouched; i++) {
+		m = touched[i];
+		if(best == -1 || area[m] > area[best] || (area[m] == area[best] && m < best))
+			best = m;
+	}
+	for(i = 0; i < ntouched; i++)
+		area[touched[i]] = 0;
+	return best == -1 ? NULL : monv[best];
+}
+
+Monitor *
+geom_get(int num) {
+	if(dirty)
+		rebuild();
+	return num >= 0 && num < nmons ? monv[num] : NULL;
+}
+
+int
+geom_count(void) {
+	if(dirty)
+		rebuild();
+	return nmons;
+}
@@ -0,0 +1,17 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef _GEOM_H
+#define _GEOM_H
+#include "dwm.h"
+
+/* Marks the index stale, call whenever a monitor is added, removed or its
+ * window area changes. It is rebuilt by the next query. */
+void geom_invalidate(void);
+/* The first monitor whose window area contains the point, or NULL */
+Monitor *geom_point(int x, int y);
+/* The monitor with the largest window area intersection, the first one on
+ * ties, or NULL if the rectangle is off all monitors */
+Monitor *geom_rect(int x, int y, int w, int h);
+/* Monitors in list order. updategeom keeps num equal to the index. */
+Monitor *geom_get(int num);
+int geom_count(void);
+#endif /* _GEOM_H */
@@ -1,7 +1,14 @@
-#include <assert.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -10,8 +17,11 @@
 #include <X11/keysym.h>
 
 #include "drw.h"
+#include "geom.h"
 #include "l.h"
 #include "dwm.h"
+#include "launch.h"
+#include "util.h"
 
 #define typeassert(L, index, type) \
 	if (!lua_is##type(L, index)) { \
@@ -25,41 +35,179 @@ ClrScheme *l_scheme = NULL;
 extern char stext[256];
 extern int bh;
 extern Drw *drw;
-extern Monitor *selmon;
+extern Monitor *mons, *selmon;
+
+struct l_Timer {
+	long long deadline; /* milliseconds on the monotonic clock */
+	long long interval; /* 0 for one-shot timers */
+	int id;
+	int ref;            /* Lua callback */
+	unsigned int strikes; /* overruns in a row */
+};
+
+/* Timers are kept in a binary min-heap ordered by deadline */
+static struct l_Timer *timers = NULL;
+static size_t ntimers = 0, timerscap = 0;
+static int lasttimerid = 0;
+static int runningtimer = 0, runningcancelled = 0;
+/* Strikes of the running timer, timers are cancelled one by one */
+static unsigned int runningstrikes = 0;
+/* Set when the running layout overran too often, it is dropped then */
+static int layoutstruck = 0;
+
+/* Callbacks queued by dwm.defer, run after the current event. The queue
+ * is swapped with the running batch, so callbacks may queue or reset. */
+static int *deferred = NULL, *deferredrun = NULL;
+static size_t ndeferred = 0, deferredcap = 0;
+static size_t ndeferredrun = 0, deferredruncap = 0, deferrednext = 0;
+
+/* Worker states, see l_u_worker_run */
+static int workerpipe[2] = { -1, -1 }; /* wakes up the event loop */
+static unsigned int workergen = 0;     /* bumped on every reload */
+
+/* Set by dwm.status.redraw, coalesced into one redraw per dispatch */
+static int bardirty = 0;
+
+/* Registry references of the Lua hooks, 0 if a hook is not set */
+static struct {
+	int client_new;
+	int status_click;
+	int status_draw;
+	int tag_click;
+} hooks;
+
+/* Kinds of callbacks, for the watchdog and its statistics */
+enum { HookClientNew, HookStatusClick, HookStatusDraw, HookTagClick,
+       HookKey, HookTimer, HookDefer, HookWorker, HookLayout, HookLast };
+
+static const char *hooknames[HookLast] = {
+	[HookClientNew] = "client.new", [HookStatusClick] = "status.click",
+	[HookStatusDraw] = "status.draw", [HookTagClick] = "tag.click",
+	[HookKey] = "keys.press", [HookTimer] = "timer", [HookDefer] = "defer",
+	[HookWorker] = "worker", [HookLayout] = "layout",
+};
+
+/* Hooks that are switched off after too many overruns in a row */
+static int *hookrefs[HookLast] = {
+	[HookClientNew] = &hooks.client_new, [HookStatusClick] = &hooks.status_click,
+	[HookStatusDraw] = &hooks.status_draw, [HookTagClick] = &hooks.tag_click,
+};
+
+static struct {
+	unsigned long calls;
+	unsigned long overruns;
+	unsigned int strikes;   /* overruns in a row */
+	long long maxtime;      /* microseconds */
+	long long totaltime;
+	int disabled;
+} hookstats[HookLast];
+
+/* Time budget per callback in milliseconds, 0 disables the watchdog */
+static int budget = 100;
+/* Number of overruns in a row after which a hook is disabled */
+static unsigned int maxstrikes = 3;
+/* Start of the innermost running callback in microseconds, 0 if none */
+static long long callstart = 0;
+
+/* Small allocations are served from free lists of 16 byte size classes */
+#define POOLGRAIN   16
+#define POOLCLASSES 16
+#define POOLCHUNK   (64 * 1024)
+#define POOLCLASS(size) (((size) + POOLGRAIN - 1) / POOLGRAIN - 1)
+
+struct l_Block {
+	struct l_Block *next;
+};
+
+static struct l_Block *freeblocks[POOLCLASSES];
+
+static struct {
+	size_t heap;           /* bytes currently allocated by Lua */
+	size_t peak;
+	size_t limit;          /* hard cap in bytes, 0 for none */
+	size_t gcthreshold;    /* heap size that starts the next GC cycle */
+	unsigned long denied;  /* allocations refused because of the cap */
+	unsigned long gccycles;
+	long long gctime;      /* microseconds spent in idle GC steps */
+	int collecting;        /* a GC cycle is in progress */
+	int protected;         /* depth of lua_pcall calls, the cap only applies inside */
+} mem;
 
 static int l_u_client_current(lua_State*);
 static int l_u_client_focusstack(lua_State*);
 static int l_u_client_focusmon(lua_State*);
 static int l_u_client_index(lua_State*);
+static int l_u_client_list(lua_State*);
 static int l_u_client_sendmon(lua_State*);
 static int l_u_drw_setscheme(lua_State*);
 static int l_u_drw_text(lua_State*);
 static int l_u_drw_textw(lua_State*);
 static int l_u_keypress(lua_State*);
+static int l_u_keys_bind_many(lua_State*);
+static int l_u_layout_register(lua_State*);
+static int l_u_layout_set(lua_State*);
+static int l_u_monitor_current(lua_State*);
+static int l_u_monitor_get(lua_State*);
+static int l_u_monitor_list(lua_State*);
+static int l_u_batch(lua_State*);
 static int l_u_client_new(lua_State*);
+static int l_u_defer(lua_State*);
 static int l_u_status_click(lua_State*);
 static int l_u_status_draw(lua_State*);
+static int l_u_status_redraw(lua_State*);
 static int l_u_status_text(lua_State*);
+static int l_u_rule_add(lua_State*);
+static int l_u_spawn(lua_State*);
 static int l_u_systray_width(lua_State*);
+static int l_u_timer_after(lua_State*);
+static int l_u_timer_cancel(lua_State*);
+static int l_u_timer_every(lua_State*);
+static int l_u_worker_run(lua_State*);
 
 struct l_Client {
-	Client *c;
+	Client *c; /* NULL once the client has been unmanaged */
+};
+
+/* Data properties of clients, looked up through a table built once in
+ * l_open_lib. Methods live in a separate table. */
+enum { PropName, PropClass, PropInstance, PropTags, PropX, PropY, PropW, PropH,
+       PropBorder, PropFloating, PropFullscreen, PropUrgent, PropFixed,
+       PropMonitor, PropWindow, PropLast };
+
+static const char *propnames[PropLast] = {
+	[PropName] = "name", [PropClass] = "class", [PropInstance] = "instance",
+	[PropTags] = "tags", [PropX] = "x", [PropY] = "y", [PropW] = "w", [PropH] = "h",
+	[PropBorder] = "border", [PropFloating] = "floating",
+	[PropFullscreen] = "fullscreen", [PropUrgent] = "urgent", [PropFixed] = "fixed",
+	[PropMonitor] = "monitor", [PropWindow] = "window",
 };
 
+/* Registry reference of the weak table mapping Client pointers to their
+ * userdata, so each client is wrapped at most once */
+static int clientcache = 0;
+
+static Client *
+l_checkclient(lua_State *L, int index) {
+	struct l_Client *w = luaL_checkudata(L, index, "dwm-client");
+
+	if (!w->c) {
+		luaL_error(L, "Client is no longer managed");
+	}
+	return w->c;
+}
+
 #define CLIENT_FN0(name, suffix) \
 	static int l_u_client_##name(lua_State *L); \
 	int \
 	l_u_client_##name(lua_State *L) { \
-		struct l_Client *w = luaL_checkudata(L, 1, "dwm-client"); \
-		name##suffix(w->c); \
+		name##suffix(l_checkclient(L, 1)); \
 		return 0; \
 	}
 
 #define CLIENT_FN1(name) \
 	static int \
 	l_u_client_##name(lua_State *L) { \
-		struct l_Client *w = luaL_checkudata(L, 1, "dwm-client"); \
-		name(w->c, (unsigned int) luaL_checkinteger(L, 2)); \
+		name(l_checkclient(L, 1), (unsigned int) luaL_checkinteger(L, 2)); \
 		return 0; \
 	}
 
@@ -71,9 +219,9 @@ CLIENT_FN1(toggletag)
 
 static int
 l_u_client_sendmon(lua_State *L) {
-	struct l_Client *w = luaL_checkudata(L, 1, "dwm-client");
+	Client *c = l_checkclient(L, 1);
 	unsigned int dir = luaL_checkinteger(L, 2);
-	sendmon(w->c, dirtomon(dir));
+	sendmon(c, dirtomon(dir));
 	return 0;
 }
 
@@ -211,33 +359,400 @@ l_u_drw_textw(lua_State *L) {
 }
 
 static int
-l_u_status_click(lua_State *L) {
+l_sethook(lua_State *L, int *hook) {
+	int i;
+
 	if (lua_gettop(L) != 1) {
 		return luaL_error(L, "Expected one argument, got %d", lua_gettop(L));
 	}
-	typeassert(L, -1, function);
+	if (!lua_isfunction(L, 1) && !lua_isnil(L, 1)) {
+		return luaL_error(L, "Expected either a function or a nil, got a %s", lua_typename(L, lua_type(L, 1)));
+	}
+
+	if (*hook) {
+		luaL_unref(L, LUA_REGISTRYINDEX, *hook);
+	}
+	*hook = lua_isnil(L, 1) ? 0 : luaL_ref(L, LUA_REGISTRYINDEX);
 
-	lua_pushliteral(L, "dwm-status-clickfn");
-	lua_rotate(L, -2, 1);
-	lua_rawset(L, LUA_REGISTRYINDEX);
+	for (i = 0; i < HookLast; i++) {
+		if (hookrefs[i] == hook) {
+			hookstats[i].disabled = 0;
+			hookstats[i].strikes = 0;
+		}
+	}
 
 	return 0;
 }
 
+static long long
+l_nowus(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long long
+l_now(void) {
+	return l_nowus() / 1000;
+}
+
+/* Count hook, aborts callbacks that run longer than the budget */
+static void
+l_watchdog(lua_State *L, lua_Debug *ar) {
+	if (budget && callstart && l_nowus() - callstart > budget * 1000LL) {
+		luaL_error(L, "callback exceeded its time budget of %d ms", budget);
+	}
+}
+
 static int
-l_u_status_draw(lua_State *L) {
-	if (lua_gettop(L) != 1) {
-		return luaL_error(L, "Expected one argument, got %d", lua_gettop(L));
+l_pcall(int hook, int ref, int nargs, int nresults) {
+	long long outerstart = callstart, elapsed;
+	unsigned int *strikes = hook == HookTimer ? &runningstrikes : &hookstats[hook].strikes;
+	int status;
+
+	lua_rawgeti(globalL, LUA_REGISTRYINDEX, ref);
+	lua_rotate(globalL, -nargs - 1, 1);
+
+	callstart = l_nowus();
+	mem.protected++;
+	status = lua_pcall(globalL, nargs, nresults, 0);
+	mem.protected--;
+	elapsed = l_nowus() - callstart;
+	callstart = outerstart;
+
+	hookstats[hook].calls++;
+	hookstats[hook].totaltime += elapsed;
+	hookstats[hook].maxtime = MAX(hookstats[hook].maxtime, elapsed);
+
+	/* Also catches callbacks stuck in C functions the hook can't interrupt */
+	if (budget && elapsed > budget * 1000LL) {
+		hookstats[hook].overruns++;
+		if (++*strikes >= maxstrikes) {
+			*strikes = 0;
+			if (hookrefs[hook] && *hookrefs[hook] == ref) {
+				fprintf(stderr, "dwm: disabling Lua hook %s after %u overruns\n",
+				        hooknames[hook], maxstrikes);
+				l_unref(ref);
+				*hookrefs[hook] = 0;
+				hookstats[hook].disabled = 1;
+			} else if (hook == HookTimer) {
+				runningcancelled = 1;
+			} else if (hook == HookLayout) {
+				layoutstruck = 1;
+			}
+		}
+	} else {
+		*strikes = 0;
+	}
+
+	if (status != LUA_OK) {
+		fprintf(stderr, "%s\n", lua_tolstring(globalL, -1, NULL));
+		lua_pop(globalL, 1);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int
+l_u_watchdog(lua_State *L) {
+	if (!lua_isnoneornil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		if (lua_getfield(L, 1, "budget") != LUA_TNIL) {
+			budget = MAX(0, luaL_checkinteger(L, -1));
+		}
+		if (lua_getfield(L, 1, "overruns") != LUA_TNIL) {
+			maxstrikes = MAX(1, luaL_checkinteger(L, -1));
+		}
+	}
+
+	lua_createtable(L, 0, 2);
+	lua_pushinteger(L, budget);
+	lua_setfield(L, -2, "budget");
+	lua_pushinteger(L, maxstrikes);
+	lua_setfield(L, -2, "overruns");
+	return 1;
+}
+
+static void *
+l_poolget(size_t size) {
+	struct l_Block *b;
+	char *chunk;
+	size_t i, class = POOLCLASS(size), bsize = (class + 1) * POOLGRAIN;
+
+	if (!freeblocks[class]) {
+		if (!(chunk = malloc(POOLCHUNK))) {
+			return NULL;
+		}
+		for (i = 0; i + bsize <= POOLCHUNK; i += bsize) {
+			b = (struct l_Block *) (chunk + i);
+			b->next = freeblocks[class];
+			freeblocks[class] = b;
+		}
+	}
+
+	b = freeblocks[class];
+	freeblocks[class] = b->next;
+	return b;
+}
+
+static void
+l_poolput(void *ptr, size_t size) {
+	struct l_Block *b = ptr;
+	size_t class = POOLCLASS(size);
+
+	b->next = freeblocks[class];
+	freeblocks[class] = b;
+}
+
+/* Allocator of the main Lua state. Lua passes the exact old size of every
+ * block, which is enough to find the size class a block came from. */
+static void *
+l_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	void *nptr;
+	int opooled, npooled;
+
+	if (!ptr) {
+		osize = 0; /* osize encodes the type of the new object */
+	}
+	opooled = ptr && osize <= POOLGRAIN * POOLCLASSES;
+	npooled = nsize > 0 && nsize <= POOLGRAIN * POOLCLASSES;
+
+	if (nsize == 0) {
+		if (opooled) {
+			l_poolput(ptr, osize);
+		} else {
+			free(ptr);
+		}
+		mem.heap -= osize;
+		return NULL;
+	}
+
+	/* Lua expects shrinking to always succeed. Outside lua_pcall a refusal
+	 * would end up in l_panic, so what dwm pushes itself isn't capped. */
+	if (mem.limit && mem.protected && nsize > osize
+	    && mem.heap - osize + nsize > mem.limit) {
+		mem.denied++;
+		return NULL;
+	}
+
+	if (opooled && npooled && POOLCLASS(osize) == POOLCLASS(nsize)) {
+		nptr = ptr;
+	} else if (!opooled && !npooled) {
+		if (!(nptr = realloc(ptr, nsize))) {
+			return NULL;
+		}
+	} else {
+		if (!(nptr = npooled ? l_poolget(nsize) : malloc(nsize))) {
+			return NULL;
+		}
+		if (ptr) {
+			memcpy(nptr, ptr, MIN(osize, nsize));
+			if (opooled) {
+				l_poolput(ptr, osize);
+			} else {
+				free(ptr);
+			}
+		}
 	}
-	typeassert(L, -1, function);
 
-	lua_pushliteral(L, "dwm-status-drawfn");
-	lua_rotate(L, -2, 1);
-	lua_rawset(L, LUA_REGISTRYINDEX);
+	mem.heap = mem.heap - osize + nsize;
+	mem.peak = MAX(mem.peak, mem.heap);
+	return nptr;
+}
 
+static int
+l_panic(lua_State *L) {
+	errx(1, "unprotected error in call to Lua API (%s)", lua_tostring(L, -1));
 	return 0;
 }
 
+static void
+l_setgcthreshold(void) {
+	mem.gcthreshold = MAX(mem.heap * 2, 256 * 1024);
+}
+
+/* The collector is stopped while callbacks run and advanced in small steps
+ * whenever the event loop is idle. Returns 1 if a cycle is still running. */
+int
+l_collect(void) {
+	long long start, now;
+	int done = 0;
+
+	if (!globalL || (!mem.collecting && mem.heap < mem.gcthreshold)) {
+		return 0;
+	}
+
+	mem.collecting = 1;
+	start = now = l_nowus();
+	while (!done && now - start < 1000) {
+		done = lua_gc(globalL, LUA_GCSTEP, 0);
+		now = l_nowus();
+	}
+	mem.gctime += now - start;
+
+	if (done) {
+		mem.collecting = 0;
+		mem.gccycles++;
+		l_setgcthreshold();
+	}
+
+	return !done;
+}
+
+static int
+l_u_memory(lua_State *L) {
+	if (!lua_isnoneornil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		if (lua_getfield(L, 1, "limit") != LUA_TNIL) {
+			mem.limit = MAX(0, luaL_checkinteger(L, -1));
+		}
+	}
+
+	lua_createtable(L, 0, 1);
+	lua_pushinteger(L, mem.limit);
+	lua_setfield(L, -2, "limit");
+	return 1;
+}
+
+static int
+l_u_stats(lua_State *L) {
+	int i;
+
+	lua_createtable(L, 0, 3);
+
+	lua_createtable(L, 0, 6);
+	lua_pushinteger(L, mem.heap);
+	lua_setfield(L, -2, "heap");
+	lua_pushinteger(L, mem.peak);
+	lua_setfield(L, -2, "peak");
+	lua_pushinteger(L, mem.limit);
+	lua_setfield(L, -2, "limit");
+	lua_pushinteger(L, mem.denied);
+	lua_setfield(L, -2, "denied");
+	lua_pushinteger(L, mem.gccycles);
+	lua_setfield(L, -2, "gccycles");
+	lua_pushnumber(L, mem.gctime / 1000.0);
+	lua_setfield(L, -2, "gctime");
+	lua_setfield(L, -2, "lua");
+
+	lua_createtable(L, 0, HookLast);
+	for (i = 0; i < HookLast; i++) {
+		lua_createtable(L, 0, 6);
+		lua_pushinteger(L, hookstats[i].calls);
+		lua_setfield(L, -2, "calls");
+		lua_pushinteger(L, hookstats[i].overruns);
+		lua_setfield(L, -2, "overruns");
+		lua_pushnumber(L, hookstats[i].maxtime / 1000.0);
+		lua_setfield(L, -2, "maxtime");
+		lua_pushnumber(L, hookstats[i].totaltime / 1000.0);
+		lua_setfield(L, -2, "totaltime");
+		lua_pushboolean(L, hookstats[i].disabled);
+		lua_setfield(L, -2, "disabled");
+		lua_setfield(L, -2, hooknames[i]);
+	}
+	lua_setfield(L, -2, "hooks");
+
+	lua_createtable(L, 0, 6);
+	lua_pushinteger(L, launch_stats.spawned);
+	lua_setfield(L, -2, "spawned");
+	lua_pushinteger(L, launch_stats.exited);
+	lua_setfield(L, -2, "exited");
+	lua_pushinteger(L, launch_stats.failed);
+	lua_setfield(L, -2, "failed");
+	lua_pushnumber(L, launch_stats.latency);
+	lua_setfield(L, -2, "latency");
+	lua_pushnumber(L, launch_stats.maxlatency);
+	lua_setfield(L, -2, "maxlatency");
+	lua_pushnumber(L, launch_stats.totallatency);
+	lua_setfield(L, -2, "totallatency");
+	lua_setfield(L, -2, "launch");
+
+	return 1;
+}
+
+/* dwm.spawn({cmd, args...}, {env = {NAME = value or false}, cwd = dir})
+ * returns the pid, or nil and an error message */
+static int
+l_u_spawn(lua_State *L) {
+	const char **argv, **env;
+	const char *cwd = NULL;
+	lua_Integer i, argc, envc = 0;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+	}
+	lua_settop(L, 2);
+
+	if ((argc = luaL_len(L, 1)) < 1) {
+		return luaL_error(L, "Expected a command");
+	}
+	argv = lua_newuserdata(L, (argc + 1) * sizeof(char *)); /* 3 */
+	for (i = 0; i < argc; i++) {
+		/* the strings stay alive in the argument table */
+		if (lua_geti(L, 1, i + 1) != LUA_TSTRING) {
+			return luaL_error(L, "Argument %d is not a string", (int) i + 1);
+		}
+		argv[i] = lua_tostring(L, -1);
+		lua_pop(L, 1);
+	}
+	argv[argc] = NULL;
+
+	lua_newtable(L); /* 4, "NAME=value" strings */
+	if (lua_istable(L, 2)) {
+		if (lua_getfield(L, 2, "cwd") != LUA_TNIL && !(cwd = lua_tostring(L, -1))) {
+			return luaL_error(L, "cwd must be a string");
+		}
+		lua_setfield(L, 4, "cwd");
+		if (lua_getfield(L, 2, "env") == LUA_TTABLE) {
+			lua_pushnil(L);
+			while (lua_next(L, 5)) {
+				if (lua_type(L, -2) != LUA_TSTRING
+				    || (!lua_isstring(L, -1) && !(lua_isboolean(L, -1) && !lua_toboolean(L, -1)))) {
+					return luaL_error(L, "env must map names to strings or false");
+				}
+				if (lua_isstring(L, -1)) {
+					lua_pushfstring(L, "%s=%s", lua_tostring(L, -2), lua_tostring(L, -1));
+				} else {
+					lua_pushvalue(L, -2);
+				}
+				lua_rawseti(L, 4, ++envc);
+				lua_pop(L, 1);
+			}
+		} else if (!lua_isnil(L, -1)) {
+			return luaL_error(L, "env must be a table");
+		}
+		lua_pop(L, 1);
+	}
+	env = lua_newuserdata(L, (envc + 1) * sizeof(char *));
+	for (i = 0; i < envc; i++) {
+		lua_rawgeti(L, 4, i + 1);
+		env[i] = lua_tostring(L, -1);
+		lua_pop(L, 1);
+	}
+	env[envc] = NULL;
+
+	if ((i = spawncmd((char *const *) argv, (char *const *) env, cwd)) == -1) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	lua_pushinteger(L, i);
+	return 1;
+}
+
+static int
+l_u_status_click(lua_State *L) {
+	return l_sethook(L, &hooks.status_click);
+}
+
+static int
+l_u_status_draw(lua_State *L) {
+	return l_sethook(L, &hooks.status_draw);
+}
+
 static int
 l_u_status_text(lua_State *L) {
 	lua_pushstring(L, stext);
@@ -252,77 +767,205 @@ l_u_systray_width(lua_State *L) {
 
 static int
 l_u_tag_click(lua_State *L) {
-	if (lua_gettop(L) != 1) {
-		return luaL_error(L, "Expected one argument");
+	return l_sethook(L, &hooks.tag_click);
+}
+
+static int
+l_u_status_redraw(lua_State *L) {
+	bardirty = 1;
+	return 0;
+}
+
+static void
+l_timer_siftup(size_t i) {
+	struct l_Timer t = timers[i];
+
+	while (i > 0 && timers[(i - 1) / 2].deadline > t.deadline) {
+		timers[i] = timers[(i - 1) / 2];
+		i = (i - 1) / 2;
 	}
-	if (!lua_isfunction(L, 1) && !lua_isnil(L, 1)) {
-		return luaL_error(L, "Expected either a function or a nil, got a %s", lua_typename(L, lua_type(L, 1)));
+	timers[i] = t;
+}
+
+static void
+l_timer_siftdown(size_t i) {
+	struct l_Timer t = timers[i];
+	size_t c;
+
+	while ((c = 2 * i + 1) < ntimers) {
+		if (c + 1 < ntimers && timers[c + 1].deadline < timers[c].deadline)
+			c++;
+		if (timers[c].deadline >= t.deadline)
+			break;
+		timers[i] = timers[c];
+		i = c;
 	}
+	timers[i] = t;
+}
 
-	lua_pushliteral(L, "dwm-tag-click");
-	lua_rotate(L, -2, 1);
-	lua_rawset(L, LUA_REGISTRYINDEX);
+static void
+l_timer_push(struct l_Timer *t) {
+	if (ntimers == timerscap) {
+		timerscap = timerscap ? timerscap * 2 : 8;
+		if (!(timers = realloc(timers, timerscap * sizeof(*timers))))
+			err(1, NULL);
+	}
+	timers[ntimers] = *t;
+	l_timer_siftup(ntimers++);
+}
 
-	return 0;
+static void
+l_timer_remove(size_t i) {
+	timers[i] = timers[--ntimers];
+	if (i == ntimers)
+		return;
+	l_timer_siftup(i);
+	l_timer_siftdown(i);
 }
 
-int
-l_call_status_click(int mods, int btn) {
-	if (!globalL) {
-		return 0;
+static int
+l_timer_add(lua_State *L, int repeat) {
+	struct l_Timer t;
+	lua_Integer ms;
+
+	ms = luaL_checkinteger(L, 1);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	if (ms < 0 || (repeat && ms == 0))
+		return luaL_error(L, "Invalid timer interval: %d", (int) ms);
+
+	lua_settop(L, 2);
+	t.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	t.id = ++lasttimerid;
+	t.strikes = 0;
+	t.interval = repeat ? ms : 0;
+	t.deadline = l_now() + ms;
+	l_timer_push(&t);
+
+	lua_pushinteger(L, t.id);
+	return 1;
+}
+
+static int
+l_u_timer_after(lua_State *L) {
+	return l_timer_add(L, 0);
+}
+
+static int
+l_u_timer_every(lua_State *L) {
+	return l_timer_add(L, 1);
+}
+
+static int
+l_u_timer_cancel(lua_State *L) {
+	int id = luaL_checkinteger(L, 1);
+	size_t i;
+
+	if (id == runningtimer) {
+		runningcancelled = 1;
+		lua_pushboolean(L, 1);
+		return 1;
 	}
 
-	lua_pushliteral(globalL, "dwm-status-clickfn");
-	if (lua_rawget(globalL, LUA_REGISTRYINDEX) != LUA_TFUNCTION) {
-		lua_pop(globalL, 1);
-		return 0;
+	for (i = 0; i < ntimers; i++) {
+		if (timers[i].id == id) {
+			luaL_unref(L, LUA_REGISTRYINDEX, timers[i].ref);
+			l_timer_remove(i);
+			lua_pushboolean(L, 1);
+			return 1;
+		}
 	}
 
-	lua_pushinteger(globalL, mods);
-	lua_pushinteger(globalL, btn);
+	lua_pushboolean(L, 0);
+	return 1;
+}
 
-	if (lua_pcall(globalL, 2, 0, 0) != LUA_OK) {
-		fprintf(stderr, "%s\n", lua_tolstring(globalL, -1, NULL));
-		return 0;
+static int
+l_u_defer(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	lua_settop(L, 1);
+
+	if (ndeferred == deferredcap) {
+		deferredcap = deferredcap ? deferredcap * 2 : 8;
+		if (!(deferred = realloc(deferred, deferredcap * sizeof(*deferred))))
+			return luaL_error(L, "Can't allocate space for deferred callback");
 	}
+	deferred[ndeferred++] = luaL_ref(L, LUA_REGISTRYINDEX);
 
-	return 1;
+	return 0;
 }
 
-int
-l_call_tag_click(int mods, int btn, int tag) {
-	if (!globalL) {
-		return 0;
+/* dwm.batch(fn) runs fn with arrange and focus postponed until it returns */
+static int
+l_u_batch(lua_State *L) {
+	int status;
+
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+
+	batchbegin();
+	status = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+	batchend();
+	if (status != LUA_OK) {
+		return lua_error(L);
 	}
 
-	lua_pushliteral(globalL, "dwm-tag-click");
-	if (lua_rawget(globalL, LUA_REGISTRYINDEX) != LUA_TFUNCTION) {
-		lua_pop(globalL, 1);
+	return lua_gettop(L);
+}
+
+int
+l_call_status_click(int mods, int btn) {
+	if (!hooks.status_click) {
 		return 0;
 	}
 
 	lua_pushinteger(globalL, mods);
 	lua_pushinteger(globalL, btn);
-	lua_pushinteger(globalL, tag);
 
-	if (lua_pcall(globalL, 3, 0, 0) != LUA_OK) {
-		fprintf(stderr, "%s\n", lua_tolstring(globalL, -1, NULL));
+	return l_pcall(HookStatusClick, hooks.status_click, 2, 0);
+}
+
+int
+l_call_tag_click(int mods, int btn, int tag) {
+	if (!hooks.tag_click) {
 		return 0;
 	}
 
-	return 1;
+	lua_pushinteger(globalL, mods);
+	lua_pushinteger(globalL, btn);
+	lua_pushinteger(globalL, tag);
+
+	return l_pcall(HookTagClick, hooks.tag_click, 3, 0);
 }
 
 static int
 l_open_lib(lua_State *L) {
+	int i;
+
 	luaL_newmetatable(L, "dwm-client");
-	luaL_setfuncs(L, ((struct luaL_Reg[]){
-		{ "__index", l_u_client_index },
-		{ NULL, NULL }}), 0);
+	lua_createtable(L, 0, PropLast);
+	for (i = 0; i < PropLast; i++) {
+		lua_pushinteger(L, i);
+		lua_setfield(L, -2, propnames[i]);
+	}
+	luaL_newlib(L, ((struct luaL_Reg[]){
+		{ "tag", l_u_client_tag },
+		{ "toggletag", l_u_client_toggletag },
+		{ "sendmon", l_u_client_sendmon },
+		{ "togglefloating", l_u_client_togglefloating },
+		{ "kill", l_u_client_kill },
+		{ "zoom", l_u_client_zoom },
+		{ NULL, NULL }}));
+	lua_pushcclosure(L, l_u_client_index, 2);
+	lua_setfield(L, -2, "__index");
 	lua_pop(L, 1);
 
 	luaL_newlib(L, ((struct luaL_Reg[]) {
 		{ "systray_width", l_u_systray_width },
+		{ "batch", l_u_batch },
+		{ "spawn", l_u_spawn },
+		{ "defer", l_u_defer },
+		{ "memory", l_u_memory },
+		{ "stats", l_u_stats },
+		{ "watchdog", l_u_watchdog },
 		{ NULL, NULL }}));
 
 #define LIB(name, items) do { \
@@ -336,7 +979,28 @@ l_open_lib(lua_State *L) {
 		{ "focusstack", l_u_client_focusstack },
 		{ "focusmon", l_u_client_focusmon },
 		{ "new", l_u_client_new },
+		{ "list", l_u_client_list },
 		{ NULL, NULL }})); /* Clients */
+	LIB(monitor, ((struct luaL_Reg[]){
+		{ "current", l_u_monitor_current },
+		{ "get", l_u_monitor_get },
+		{ "list", l_u_monitor_list },
+		{ NULL, NULL }})); /* Monitors */
+	LIB(rule, ((struct luaL_Reg[]){
+		{ "add", l_u_rule_add },
+		{ NULL, NULL }}));  /* Rules */
+	LIB(layout, ((struct luaL_Reg[]){
+		{ "register", l_u_layout_register },
+		{ "set", l_u_layout_set },
+		{ NULL, NULL }}));  /* Layouts */
+	LIB(worker, ((struct luaL_Reg[]){
+		{ "run", l_u_worker_run },
+		{ NULL, NULL }}));  /* Worker states */
+	LIB(timer, ((struct luaL_Reg[]){
+		{ "after", l_u_timer_after },
+		{ "every", l_u_timer_every },
+		{ "cancel", l_u_timer_cancel },
+		{ NULL, NULL }}));  /* Timers */
 	LIB(drw, ((struct luaL_Reg[]){
 		{ "textw", l_u_drw_textw },
 		{ "text", l_u_drw_text },
@@ -346,6 +1010,7 @@ l_open_lib(lua_State *L) {
 		{ "text", l_u_status_text },
 		{ "draw", l_u_status_draw },
 		{ "click", l_u_status_click },
+		{ "redraw", l_u_status_redraw },
 		{ NULL, NULL }})); /* Status */
 	LIB(tag, ((struct luaL_Reg[]){
 		{ "click", l_u_tag_click },
@@ -357,6 +1022,7 @@ l_open_lib(lua_State *L) {
 	lua_pushliteral(L, "keys");
 	luaL_newlib(L, ((struct luaL_Reg[]){
 		{"press", l_u_keypress},
+		{"bind_many", l_u_keys_bind_many},
 		{NULL, NULL}}));
 
 	lua_pushliteral(L, "mod1");
@@ -386,67 +1052,246 @@ l_open_lib(lua_State *L) {
 }
 
 void
-l_loadconfig() {
-	char *confname;
-
-	if (!globalL) {
-		l_init();
-		return;
+l_unref(int ref) {
+	if (globalL && ref) {
+		luaL_unref(globalL, LUA_REGISTRYINDEX, ref);
 	}
+}
 
-	/* Load config */
-	(void) asprintf(&confname, "%s/.dwm-gbe.lua", getenv("HOME"));
+/* Drops everything the previous configuration registered, so a reload
+ * doesn't leave stale hooks, timers or key grabs behind */
+static void
+l_reset(void) {
+	size_t i;
 
-	if (luaL_dofile(globalL, confname)) {
-		if (lua_gettop(globalL) >= 1 && lua_isstring(globalL, -1)) {
-			printf("%s\n", lua_tolstring(globalL, -1, NULL));
-		} else {
-			printf("%s: something went wrong, but I don't have an error message.", confname);
-			printf("\t%d things are on  the stack\n", lua_gettop(globalL));
-		}
-	}
+	l_unref(hooks.client_new);
+	l_unref(hooks.status_click);
+	l_unref(hooks.status_draw);
+	l_unref(hooks.tag_click);
+	memset(&hooks, 0, sizeof(hooks));
 
-	free(confname);
-}
+	for (i = 0; i < ntimers; i++) {
+		l_unref(timers[i].ref);
+	}
+	ntimers = 0;
+	runningcancelled = 1;
 
-void
-l_init() {
-	lua_State *L = luaL_newstate();
-	if (!L) {
-		err(1, NULL);
+	for (i = 0; i < ndeferred; i++) {
+		l_unref(deferred[i]);
 	}
-	globalL = L;
+	ndeferred = 0;
+	/* The running callback is released by l_dispatch */
+	for (i = deferrednext; i < ndeferredrun; i++) {
+		l_unref(deferredrun[i]);
+	}
+	ndeferredrun = 0;
 
-	luaL_openlibs(L);
-	luaL_requiref(L, "dwm", l_open_lib, 1);
+	/* Results of jobs queued by the old configuration are dropped */
+	workergen++;
 
-	lua_pushliteral(L, "dwm-keypress");
-	lua_newtable(L);
-	lua_rawset(L, LUA_REGISTRYINDEX);
+	unbindkeys();
+	resetrules();
 
-	l_loadconfig();
+	for (i = 0; i < (size_t)layout_count(); i++) {
+		l_unref(layout_get(i)->ref);
+	}
+	resetlayouts();
 }
 
-int
-l_call_status_drawfn(int x, int mw, int sel) {
-	int res, isnumber;
+static int
+l_cachewriter(lua_State *L, const void *p, size_t sz, void *ud) {
+	return fwrite(p, 1, sz, ud) != sz;
+}
 
-	if (!globalL) {
-		return -1;
+/* Loads the precompiled chunk from cachename if its header matches */
+static int
+l_loadcache(lua_State *L, const char *cachename, const char *header, const char *chunkname) {
+	FILE *f;
+	char *buf;
+	long len;
+	size_t hlen = strlen(header);
+	int status;
+
+	if (!(f = fopen(cachename, "rb"))) {
+		return 0;
+	}
+	if (fseek(f, 0, SEEK_END) || (len = ftell(f)) < (long) hlen || fseek(f, 0, SEEK_SET)) {
+		fclose(f);
+		return 0;
+	}
+	if (!(buf = malloc(len))) {
+		fclose(f);
+		return 0;
+	}
+	if (fread(buf, 1, len, f) != (size_t) len || memcmp(buf, header, hlen)) {
+		free(buf);
+		fclose(f);
+		return 0;
 	}
+	fclose(f);
 
-	lua_pushliteral(globalL, "dwm-status-drawfn");
-	if (lua_rawget(globalL, LUA_REGISTRYINDEX) != LUA_TFUNCTION) {
-		lua_pop(globalL, 1);
-		return -1;
+	status = luaL_loadbufferx(L, buf + hlen, len - hlen, chunkname, "b");
+	free(buf);
+	if (status != LUA_OK) {
+		lua_pop(L, 1);
+		return 0;
 	}
 
-	lua_pushinteger(globalL, x);
-	lua_pushinteger(globalL, mw);
+	return 1;
+}
+
+/* Dumps the function on top of the stack to cachename */
+static void
+l_writecache(lua_State *L, const char *cachename, const char *header) {
+	FILE *f;
+	char *tmpname;
+	int fd, failed;
+
+	if (asprintf(&tmpname, "%s.tmp", cachename) == -1) {
+		return;
+	}
+	if ((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+		free(tmpname);
+		return;
+	}
+	if (!(f = fdopen(fd, "wb"))) {
+		close(fd);
+		unlink(tmpname);
+		free(tmpname);
+		return;
+	}
+
+	failed = fputs(header, f) == EOF;
+	failed |= lua_dump(L, l_cachewriter, f, 0) != 0;
+	failed |= fclose(f) != 0;
+	if (failed || rename(tmpname, cachename) == -1) {
+		unlink(tmpname);
+	}
+	free(tmpname);
+}
+
+/* Like luaL_loadfile, but goes through a bytecode cache next to the file
+ * that is keyed by the path, modification time, size and inode */
+static int
+l_loadfile(lua_State *L, const char *confname) {
+	struct stat st;
+	char *cachename = NULL, *header = NULL, *chunkname = NULL;
+	int status;
+
+	if (stat(confname, &st) == -1) {
+		return luaL_loadfile(L, confname);
+	}
+	/* The pointers are undefined after a failed asprintf */
+	if (asprintf(&cachename, "%s.cache", confname) == -1) {
+		cachename = NULL;
+	}
+	if (asprintf(&chunkname, "@%s", confname) == -1) {
+		chunkname = NULL;
+	}
+	if (asprintf(&header, "dwm-gbe bytecode cache\n%s\n%lld.%09ld %lld %llu\n", confname,
+	             (long long) st.st_mtim.tv_sec, (long) st.st_mtim.tv_nsec,
+	             (long long) st.st_size, (unsigned long long) st.st_ino) == -1) {
+		header = NULL;
+	}
+	if (!cachename || !chunkname || !header) {
+		free(cachename);
+		free(chunkname);
+		free(header);
+		return luaL_loadfile(L, confname);
+	}
+
+	if (l_loadcache(L, cachename, header, chunkname)) {
+		status = LUA_OK;
+	} else if ((status = luaL_loadfile(L, confname)) == LUA_OK) {
+		l_writecache(L, cachename, header);
+	}
+
+	free(cachename);
+	free(chunkname);
+	free(header);
+	return status;
+}
+
+void
+l_loadconfig() {
+	char *confname;
+	int status;
+
+	if (!globalL) {
+		l_init();
+		return;
+	}
+
+	/* Key grabs are reconciled once the new configuration is in place */
+	batchbegin();
+	l_reset();
+	lua_gc(globalL, LUA_GCRESTART, 0);
+
+	/* Load config */
+	(void) asprintf(&confname, "%s/.dwm-gbe.lua", getenv("HOME"));
+
+	if ((status = l_loadfile(globalL, confname)) == LUA_OK) {
+		mem.protected++;
+		status = lua_pcall(globalL, 0, 0, 0);
+		mem.protected--;
+	}
+	if (status != LUA_OK) {
+		if (lua_gettop(globalL) >= 1 && lua_isstring(globalL, -1)) {
+			printf("%s\n", lua_tolstring(globalL, -1, NULL));
+		} else {
+			printf("%s: something went wrong, but I don't have an error message.", confname);
+			printf("\t%d things are on  the stack\n", lua_gettop(globalL));
+		}
+		lua_pop(globalL, 1);
+	}
+	batchend();
+
+	free(confname);
+
+	/* Start out clean, from here on garbage is collected when idle */
+	lua_gc(globalL, LUA_GCCOLLECT, 0);
+	lua_gc(globalL, LUA_GCSTOP, 0);
+	mem.collecting = 0;
+	l_setgcthreshold();
+}
+
+void
+l_init() {
+	lua_State *L = lua_newstate(l_alloc, NULL);
+	if (!L) {
+		err(1, NULL);
+	}
+	globalL = L;
+	lua_atpanic(L, l_panic);
+
+	luaL_openlibs(L);
+	luaL_requiref(L, "dwm", l_open_lib, 1);
+	lua_sethook(L, l_watchdog, LUA_MASKCOUNT, 1000);
+
+	/* Client wrappers are only kept alive by the scripts using them */
+	lua_newtable(L);
+	lua_createtable(L, 0, 1);
+	lua_pushliteral(L, "v");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	clientcache = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	l_loadconfig();
+}
+
+int
+l_call_status_drawfn(int x, int mw, int sel) {
+	int res, isnumber;
+
+	if (!hooks.status_draw) {
+		return -1;
+	}
+
+	lua_pushinteger(globalL, x);
+	lua_pushinteger(globalL, mw);
 	lua_pushboolean(globalL, sel);
 
-	if (lua_pcall(globalL, 3, 1, 0) != LUA_OK) {
-		fprintf(stderr, "%s\n", lua_tolstring(globalL, -1, NULL));
+	if (!l_pcall(HookStatusDraw, hooks.status_draw, 3, 1)) {
 		return -1;
 	}
 
@@ -468,9 +1313,8 @@ l_call_status_drawfn(int x, int mw, int sel) {
 
 static int
 l_u_keypress(lua_State *L) {
-	int modifiers, type, ungrab;
+	int modifiers, ref = 0;
 	const char *symname;
-	char *key;
 	KeySym ksym;
 
 	if (lua_gettop(L) != 3) {
@@ -482,7 +1326,6 @@ l_u_keypress(lua_State *L) {
 		return luaL_error(L, "Expected either a function or nil as last argument, got a %s!",
 		                  lua_typename(L, lua_type(L, 3)));
 	}
-	ungrab = lua_isnil(L, 3);
 
 	modifiers = (int) lua_tonumber(L, 1);
 	symname = lua_tolstring(L, 2, NULL);
@@ -494,125 +1337,172 @@ l_u_keypress(lua_State *L) {
 		return luaL_error(L, "Key sym \"%s\" is unknown", symname);
 	}
 
-	lua_pushliteral(L, "dwm-keypress");
-	type = lua_rawget(L, LUA_REGISTRYINDEX);
-	assert(type == LUA_TTABLE);
-
-	asprintf(&key, "%x-%s", modifiers, symname);
-	if (key == NULL) {
-		return luaL_error(L, "Can't allocate space for table key!");
+	if (!lua_isnil(L, 3)) {
+		ref = luaL_ref(L, LUA_REGISTRYINDEX);
 	}
 
-	lua_pushstring(L, key);
-	lua_rotate(L, -3, -1); /* If ungrab is true, we've already got a nil on the stack */
-	lua_rawset(L, -3);
-
-	free(key);
-
-	grabkey(modifiers, ksym, ungrab);
+	/* bindkey hands back the handler it replaced */
+	if ((ref = bindkey(modifiers, ksym, ref)) != 0) {
+		luaL_unref(L, LUA_REGISTRYINDEX, ref);
+	}
 
 	return 0;
 }
 
-int
-l_call_keypress(unsigned int mod, KeySym keysym) {
-	int type;
-	char *symname, *key;
+/* dwm.keys.bind_many { {mods, key, fn}, ... } sets many handlers at once. The
+ * root window grabs are reconciled once, after all of them are in place. */
+static int
+l_u_keys_bind_many(lua_State *L) {
+	struct {
+		int mod;
+		KeySym keysym;
+		int ref;
+	} *entries;
+	const char *symname;
+	lua_Integer i, n;
 
-	if (!globalL) {
-		return 0;
-	}
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+	n = luaL_len(L, 1);
+	entries = lua_newuserdata(L, (n ? n : 1) * sizeof(*entries));
 
-	lua_pushliteral(globalL, "dwm-keypress");
-	type = lua_rawget(globalL, LUA_REGISTRYINDEX);
-	assert(type == LUA_TTABLE);
+	/* Check everything before touching any binding */
+	for (i = 0; i < n; i++) {
+		if (lua_geti(L, 1, i + 1) != LUA_TTABLE) {
+			return luaL_error(L, "Entry %d: expected a table", (int) i + 1);
+		}
+		lua_geti(L, -1, 1);
+		lua_geti(L, -2, 2);
+		lua_geti(L, -3, 3);
+		if (!lua_isinteger(L, -3) || !(symname = lua_tostring(L, -2))
+		    || (!lua_isfunction(L, -1) && !lua_isnil(L, -1))) {
+			return luaL_error(L, "Entry %d: expected {mods, key, function or nil}",
+			                  (int) i + 1);
+		}
+		if ((entries[i].keysym = XStringToKeysym(symname)) == NoSymbol) {
+			return luaL_error(L, "Entry %d: key sym \"%s\" is unknown",
+			                  (int) i + 1, symname);
+		}
+		entries[i].mod = (int) lua_tointeger(L, -3);
+		lua_settop(L, 2);
+	}
+	for (i = 0; i < n; i++) {
+		lua_geti(L, 1, i + 1);
+		entries[i].ref = lua_geti(L, -1, 3) == LUA_TNIL ? 0 : luaL_ref(L, LUA_REGISTRYINDEX);
+		lua_settop(L, 2);
+	}
 
-	symname = XKeysymToString(keysym);
-	asprintf(&key, "%x-%s", mod, symname);
-	if (!key) {
-		fprintf(stderr, "Malloc failure!\n");
-		return 0;
+	batchbegin();
+	for (i = 0; i < n; i++) {
+		l_unref(bindkey(entries[i].mod, entries[i].keysym, entries[i].ref));
 	}
+	batchend();
 
-	lua_pushstring(globalL, key);
-	type = lua_rawget(globalL, -2);
-	free(key);
+	return 0;
+}
 
-	if (type != LUA_TFUNCTION) {
-		fprintf(stderr, "Got something that's a %s, expected a function! (sym='%s')\n",
-		        lua_typename(globalL, type), symname);
+/* nameref is the string made by l_keyname when the key was bound */
+int
+l_call_keypress(int ref, int nameref, unsigned int mod) {
+	if (!globalL) {
 		return 0;
 	}
 
 	lua_pushinteger(globalL, mod);
-	lua_pushstring(globalL, symname);
-
-	if (lua_pcall(globalL, 2, 0, 0) != LUA_OK) {
-		fprintf(stderr, "%s\n", lua_tolstring(globalL, -1, NULL));
-		return 0;
-	}
+	lua_rawgeti(globalL, LUA_REGISTRYINDEX, nameref);
 
-	return 1;
+	return l_pcall(HookKey, ref, 2, 0);
 }
 
+/* Returns a registry reference to the name of keysym */
 int
-l_u_client_new(lua_State *L) {
-	if (lua_gettop(L) != 1) {
-		return luaL_error(L, "Expected one argument, got %d", lua_gettop(L));
+l_keyname(KeySym keysym) {
+	if (!globalL) {
+		return 0;
 	}
-	typeassert(L, -1, function);
 
-	lua_pushliteral(L, "dwm-client-new");
-	lua_rotate(L, -2, 1);
-	lua_rawset(L, LUA_REGISTRYINDEX);
+	lua_pushstring(globalL, XKeysymToString(keysym));
+	return luaL_ref(globalL, LUA_REGISTRYINDEX);
+}
 
-	return 0;
+static int
+l_u_client_new(lua_State *L) {
+	return l_sethook(L, &hooks.client_new);
 }
 
+/* Upvalues: 1 is the property table, 2 is the method table */
 static int
 l_u_client_index(lua_State *L) {
-	struct l_Client *w;
+	Client *c;
+
 	int prop;
-	const char *propnames[] = {
-		"name", "class", "instance",
-		"tag", "toggletag",
-		"sendmon",
-		"togglefloating",
-		"kill",
-		"zoom",
-		NULL
-	};
-
-	w = luaL_checkudata(L, 1, "dwm-client");
-
-	prop = luaL_checkoption(L, 2, NULL, propnames);
+
+	lua_settop(L, 2);
+	lua_pushvalue(L, 2);
+	if (lua_rawget(L, lua_upvalueindex(1)) != LUA_TNUMBER) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, 2);
+		lua_rawget(L, lua_upvalueindex(2));
+		return 1;
+	}
+
+	c = l_checkclient(L, 1);
+	prop = lua_tointeger(L, -1);
 	switch (prop) {
-		case 0:
-			lua_pushstring(L, w->c->name);
+		case PropName:
+		case PropClass:
+		case PropInstance:
+			/* The strings are kept in the userdata's user value until
+			 * l_client_changed drops them */
+			if (lua_getuservalue(L, 1) != LUA_TTABLE) {
+				lua_pop(L, 1);
+				lua_createtable(L, PropInstance + 1, 0);
+				lua_pushvalue(L, -1);
+				lua_setuservalue(L, 1);
+			}
+			if (lua_rawgeti(L, -1, prop) == LUA_TNIL) {
+				lua_pop(L, 1);
+				lua_pushstring(L, prop == PropName ? c->name :
+				               prop == PropClass ? c->class : c->instance);
+				lua_pushvalue(L, -1);
+				lua_rawseti(L, -3, prop);
+			}
+			break;
+		case PropTags:
+			lua_pushinteger(L, c->tags);
+			break;
+		case PropX:
+			lua_pushinteger(L, c->x);
 			break;
-		case 1:
-			lua_pushstring(L, w->c->class);
+		case PropY:
+			lua_pushinteger(L, c->y);
 			break;
-		case 2:
-			lua_pushstring(L, w->c->instance);
+		case PropW:
+			lua_pushinteger(L, c->w);
 			break;
-		case 3:
-			lua_pushcfunction(L, l_u_client_tag);
+		case PropH:
+			lua_pushinteger(L, c->h);
 			break;
-		case 4:
-			lua_pushcfunction(L, l_u_client_toggletag);
+		case PropBorder:
+			lua_pushinteger(L, c->bw);
 			break;
-		case 5:
-			lua_pushcfunction(L, l_u_client_sendmon);
+		case PropFloating:
+			lua_pushboolean(L, c->isfloating);
 			break;
-		case 6:
-			lua_pushcfunction(L, l_u_client_togglefloating);
+		case PropFullscreen:
+			lua_pushboolean(L, c->isfullscreen);
 			break;
-		case 7:
-			lua_pushcfunction(L, l_u_client_kill);
+		case PropUrgent:
+			lua_pushboolean(L, c->isurgent);
 			break;
-		case 8:
-			lua_pushcfunction(L, l_u_client_zoom);
+		case PropFixed:
+			lua_pushboolean(L, c->isfixed);
+			break;
+		case PropMonitor:
+			lua_pushinteger(L, c->mon->num);
+			break;
+		case PropWindow:
+			lua_pushinteger(L, c->win);
 			break;
 		default:
 			return luaL_error(L, "Unknown property requested!");
@@ -625,14 +1515,355 @@ static struct l_Client *
 l_client_wrap(lua_State *L, Client *c) {
 	struct l_Client *wrapper;
 
+	lua_rawgeti(L, LUA_REGISTRYINDEX, clientcache);
+	if (lua_rawgetp(L, -1, c) == LUA_TUSERDATA) {
+		lua_remove(L, -2);
+		return lua_touserdata(L, -1);
+	}
+	lua_pop(L, 1);
+
 	wrapper = lua_newuserdata(L, sizeof(*wrapper));
 	wrapper->c = c;
 	luaL_getmetatable(L, "dwm-client");
 	lua_setmetatable(L, -2);
 
+	lua_pushvalue(L, -1);
+	lua_rawsetp(L, -3, c);
+	lua_remove(L, -2);
+
 	return wrapper;
 }
 
+/* Called when the title or class of c changed */
+void
+l_client_changed(Client *c) {
+	if (!globalL) {
+		return;
+	}
+
+	lua_rawgeti(globalL, LUA_REGISTRYINDEX, clientcache);
+	if (lua_rawgetp(globalL, -1, c) == LUA_TUSERDATA) {
+		lua_pushnil(globalL);
+		lua_setuservalue(globalL, -2);
+	}
+	lua_pop(globalL, 2);
+}
+
+void
+l_client_unmanage(Client *c) {
+	struct l_Client *wrapper;
+
+	if (!globalL) {
+		return;
+	}
+
+	lua_rawgeti(globalL, LUA_REGISTRYINDEX, clientcache);
+	if (lua_rawgetp(globalL, -1, c) == LUA_TUSERDATA) {
+		wrapper = lua_touserdata(globalL, -1);
+		wrapper->c = NULL;
+		lua_pushnil(globalL);
+		lua_rawsetp(globalL, -3, c);
+	}
+	lua_pop(globalL, 2);
+}
+
+/* Layouts get plain numbers and return a flat array of x, y, w, h for
+ * each client, so no table is built per client */
+int
+l_call_layout(int ref, const LayoutArgs *a, int n, Geom *g) {
+	lua_Integer v[4];
+	int i, j, ok = 1;
+
+	if (!globalL) {
+		return 0;
+	}
+
+	lua_pushinteger(globalL, n);
+	lua_pushinteger(globalL, a->area.x);
+	lua_pushinteger(globalL, a->area.y);
+	lua_pushinteger(globalL, a->area.w);
+	lua_pushinteger(globalL, a->area.h);
+	lua_pushnumber(globalL, a->mfact);
+	lua_pushinteger(globalL, a->nmaster);
+	if (!l_pcall(HookLayout, ref, 7, 1)) {
+		return 0;
+	}
+	if (layoutstruck) {
+		layoutstruck = 0;
+		lua_pop(globalL, 1);
+		return 0;
+	}
+
+	if (!lua_istable(globalL, -1)) {
+		ok = 0;
+	}
+	for (i = 0; ok && i < n; i++) {
+		for (j = 0; ok && j < 4; j++) {
+			lua_rawgeti(globalL, -1, 4 * i + j + 1);
+			v[j] = lua_tointegerx(globalL, -1, &ok);
+			ok = ok && v[j] >= INT_MIN && v[j] <= INT_MAX;
+			lua_pop(globalL, 1);
+		}
+		if (!ok || v[2] <= 0 || v[3] <= 0) {
+			ok = 0;
+			break;
+		}
+		g[i].x = v[0];
+		g[i].y = v[1];
+		g[i].w = v[2];
+		g[i].h = v[3];
+	}
+	if (!ok) {
+		fprintf(stderr, "dwm: layout didn't return %d integers with positive sizes\n", 4 * n);
+	}
+	lua_pop(globalL, 1);
+
+	return ok;
+}
+
+static int
+l_u_layout_register(lua_State *L) {
+	const char *symbol = luaL_checkstring(L, 1);
+	int i, ref, old = 0;
+	Monitor *m;
+
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	if ((i = layout_find(symbol)) != -1) {
+		if (layout_get(i)->arrange) {
+			return luaL_error(L, "Can't replace the built-in layout %s", symbol);
+		}
+		old = layout_get(i)->ref;
+	}
+
+	lua_settop(L, 2);
+	ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	if ((i = layout_register(symbol, ref)) == -1) {
+		l_unref(ref);
+		return luaL_error(L, "Too many layouts");
+	}
+	l_unref(old);
+
+	/* Monitors already using it are laid out again */
+	for (m = mons; m; m = m->next) {
+		if (m->lt[m->sellt] == i) {
+			setlayout(m, i);
+		}
+	}
+
+	lua_pushinteger(L, i);
+	return 1;
+}
+
+static int
+l_u_layout_set(lua_State *L) {
+	Monitor *m = selmon;
+	int i = -1;
+
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		if ((i = layout_find(lua_tostring(L, 1))) == -1) {
+			return luaL_error(L, "No layout %s", lua_tostring(L, 1));
+		}
+	} else if (!lua_isnoneornil(L, 1)) {
+		i = luaL_checkinteger(L, 1);
+		if (!layout_get(i)) {
+			return luaL_error(L, "No layout %d", i);
+		}
+	}
+	if (!lua_isnoneornil(L, 2) && !(m = geom_get(luaL_checkinteger(L, 2)))) {
+		return luaL_error(L, "No monitor %d", (int)lua_tointeger(L, 2));
+	}
+
+	setlayout(m, i);
+	return 0;
+}
+
+/* dwm.rule.add{class=, instance=, title=, tags=, floating=, monitor=, exact=} */
+static int
+l_u_rule_add(lua_State *L) {
+	Rule r = { NULL, NULL, NULL, 0, False, -1, False };
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	if (lua_getfield(L, 1, "class") != LUA_TNIL)
+		r.class = luaL_checkstring(L, -1);
+	if (lua_getfield(L, 1, "instance") != LUA_TNIL)
+		r.instance = luaL_checkstring(L, -1);
+	if (lua_getfield(L, 1, "title") != LUA_TNIL)
+		r.title = luaL_checkstring(L, -1);
+	if (lua_getfield(L, 1, "tags") != LUA_TNIL)
+		r.tags = luaL_checkinteger(L, -1);
+	if (lua_getfield(L, 1, "floating") != LUA_TNIL)
+		r.isfloating = lua_toboolean(L, -1);
+	if (lua_getfield(L, 1, "monitor") != LUA_TNIL)
+		r.monitor = luaL_checkinteger(L, -1);
+	if (lua_getfield(L, 1, "exact") != LUA_TNIL)
+		r.exact = lua_toboolean(L, -1);
+	if (r.title && !*r.title) {
+		return luaL_error(L, "Title patterns can't be empty");
+	}
+
+	if (rule_add(&r) == -1) {
+		return luaL_error(L, "Too many rules");
+	}
+
+	return 0;
+}
+
+/* What dwm.client.list filters on, -1 and ~0 match everything */
+struct l_Filter {
+	int mon, floating;
+	unsigned int tags, classhash;
+	const char *class, *instance;
+};
+
+static int
+l_client_matches(const struct l_Filter *f, Client *c) {
+	return (c->tags & f->tags)
+	    && (f->mon < 0 || c->mon->num == f->mon)
+	    && (f->floating < 0 || !c->isfloating == !f->floating)
+	    && (!f->class || (c->classhash == f->classhash && !strcmp(c->class, f->class)))
+	    && (!f->instance || !strcmp(c->instance, f->instance));
+}
+
+/* Class and tags are looked up in the indexes dwm keeps, everything else
+ * is checked on the clients found there */
+static int
+l_u_client_list(lua_State *L) {
+	struct l_Filter f = { -1, -1, ~0, 0, NULL, NULL };
+	unsigned int t;
+	int i = 0;
+	Client *c;
+	Monitor *m;
+
+	if (!lua_isnoneornil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		if (lua_getfield(L, 1, "monitor") != LUA_TNIL)
+			f.mon = luaL_checkinteger(L, -1);
+		if (lua_getfield(L, 1, "tags") != LUA_TNIL)
+			f.tags = luaL_checkinteger(L, -1);
+		if (lua_getfield(L, 1, "floating") != LUA_TNIL)
+			f.floating = lua_toboolean(L, -1);
+		if (lua_getfield(L, 1, "class") != LUA_TNIL) {
+			f.class = luaL_checkstring(L, -1);
+			f.classhash = strhash(f.class);
+		}
+		if (lua_getfield(L, 1, "instance") != LUA_TNIL)
+			f.instance = luaL_checkstring(L, -1);
+	}
+
+	lua_newtable(L);
+	if (f.class) {
+		for (c = classclients(f.classhash); c; c = c->classnext) {
+			if (l_client_matches(&f, c)) {
+				l_client_wrap(L, c);
+				lua_rawseti(L, -2, ++i);
+			}
+		}
+	} else if (f.tags != ~0u) {
+		for (t = 0; t < MAXTAGS; t++) {
+			if (!(f.tags & 1u << t))
+				continue;
+			/* clients on several of the tags are listed under the first */
+			for (c = tagclients(t); c; c = c->tagnext[t]) {
+				if (!(c->tags & f.tags & ((1u << t) - 1)) && l_client_matches(&f, c)) {
+					l_client_wrap(L, c);
+					lua_rawseti(L, -2, ++i);
+				}
+			}
+		}
+	} else {
+		for (m = mons; m; m = m->next) {
+			if (f.mon >= 0 && m->num != f.mon)
+				continue;
+			for (c = m->clients; c; c = c->next) {
+				if (l_client_matches(&f, c)) {
+					l_client_wrap(L, c);
+					lua_rawseti(L, -2, ++i);
+				}
+			}
+		}
+	}
+
+	return 1;
+}
+
+static void
+l_pushmonitor(lua_State *L, Monitor *m) {
+	unsigned int occ = 0, urg = 0;
+	int n = 0;
+	Client *c;
+
+	for (c = m->clients; c; c = c->next, n++) {
+		occ |= c->tags;
+		if (c->isurgent)
+			urg |= c->tags;
+	}
+
+	lua_createtable(L, 0, 17);
+#define FIELD(name, push, value) do { \
+		push(L, value); \
+		lua_setfield(L, -2, name); \
+	} while (0)
+	FIELD("num", lua_pushinteger, m->num);
+	FIELD("x", lua_pushinteger, m->mx);
+	FIELD("y", lua_pushinteger, m->my);
+	FIELD("w", lua_pushinteger, m->mw);
+	FIELD("h", lua_pushinteger, m->mh);
+	FIELD("wx", lua_pushinteger, m->wx);
+	FIELD("wy", lua_pushinteger, m->wy);
+	FIELD("ww", lua_pushinteger, m->ww);
+	FIELD("wh", lua_pushinteger, m->wh);
+	FIELD("tags", lua_pushinteger, m->tagset[m->seltags]);
+	FIELD("prevtags", lua_pushinteger, m->tagset[m->seltags ^ 1]);
+	FIELD("occupied", lua_pushinteger, occ);
+	FIELD("urgent", lua_pushinteger, urg);
+	FIELD("clients", lua_pushinteger, n);
+	FIELD("mfact", lua_pushnumber, m->mfact);
+	FIELD("nmaster", lua_pushinteger, m->nmaster);
+	FIELD("layout", lua_pushstring, m->ltsymbol);
+	FIELD("selected", lua_pushboolean, m == selmon);
+#undef FIELD
+}
+
+static int
+l_u_monitor_current(lua_State *L) {
+	if (!selmon) {
+		lua_pushnil(L);
+	} else {
+		l_pushmonitor(L, selmon);
+	}
+
+	return 1;
+}
+
+static int
+l_u_monitor_get(lua_State *L) {
+	int num = luaL_checkinteger(L, 1);
+	Monitor *m;
+
+	if (!(m = geom_get(num))) {
+		lua_pushnil(L);
+	} else {
+		l_pushmonitor(L, m);
+	}
+
+	return 1;
+}
+
+static int
+l_u_monitor_list(lua_State *L) {
+	int n;
+	Monitor *m;
+
+	for (n = 0, m = mons; m; m = m->next, n++);
+	lua_createtable(L, n, 0);
+	for (n = 0, m = mons; m; m = m->next) {
+		l_pushmonitor(L, m);
+		lua_rawseti(L, -2, ++n);
+	}
+
+	return 1;
+}
+
 static int
 l_u_client_current(lua_State *L) {
 	if (!selmon || !selmon->sel) {
@@ -661,22 +1892,450 @@ l_u_client_focusmon(lua_State *L) {
 
 int
 l_call_client_new(Client *client) {
-	if (!globalL) {
+	if (!hooks.client_new) {
 		return 0;
 	}
 
-	lua_pushliteral(globalL, "dwm-client-new");
-	if (lua_rawget(globalL, LUA_REGISTRYINDEX) != LUA_TFUNCTION) {
-		lua_pop(globalL, 1);
+	l_client_wrap(globalL, client);
+
+	return l_pcall(HookClientNew, hooks.client_new, 1, 0);
+}
+
+/* Values crossing between Lua states are serialized into plain buffers */
+struct l_Buf {
+	char *data;
+	size_t len, cap;
+};
+
+struct l_Job {
+	int callback;      /* registry reference in the main state */
+	unsigned int gen;  /* configuration generation that queued the job */
+	struct l_Buf code; /* dumped function */
+	struct l_Buf args; /* serialized arguments, or results once done */
+	int nargs;
+	int ok;
+	struct l_Job *next;
+};
+
+#define NWORKERS       2
+#define SERIALIZEDEPTH 16
+
+static pthread_mutex_t jobslock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobscond = PTHREAD_COND_INITIALIZER;
+static struct l_Job *jobs = NULL, **jobstail = &jobs;         /* pending */
+static struct l_Job *donejobs = NULL, **donejobstail = &donejobs;
+
+static int
+l_bufadd(struct l_Buf *b, const void *p, size_t len) {
+	char *data;
+	size_t cap;
+
+	if (b->len + len > b->cap) {
+		for (cap = b->cap ? b->cap : 64; cap < b->len + len; cap *= 2);
+		if (!(data = realloc(b->data, cap))) {
+			return 0;
+		}
+		b->data = data;
+		b->cap = cap;
+	}
+	memcpy(b->data + b->len, p, len);
+	b->len += len;
+	return 1;
+}
+
+static int
+l_bufwriter(lua_State *L, const void *p, size_t sz, void *ud) {
+	return !l_bufadd(ud, p, sz);
+}
+
+/* Appends the value at index to b. Only nil, booleans, numbers, strings and
+ * tables of those can be serialized. Returns an error message or NULL. */
+static const char *
+l_serialize(lua_State *L, int index, struct l_Buf *b, int depth) {
+	lua_Integer i;
+	lua_Number n;
+	const char *str, *e;
+	size_t len;
+	char tag;
+
+	index = lua_absindex(L, index);
+	switch (lua_type(L, index)) {
+	case LUA_TNIL:
+		tag = 'n';
+		return l_bufadd(b, &tag, 1) ? NULL : "out of memory";
+	case LUA_TBOOLEAN:
+		tag = lua_toboolean(L, index) ? 't' : 'f';
+		return l_bufadd(b, &tag, 1) ? NULL : "out of memory";
+	case LUA_TNUMBER:
+		if (lua_isinteger(L, index)) {
+			tag = 'i';
+			i = lua_tointeger(L, index);
+			return l_bufadd(b, &tag, 1) && l_bufadd(b, &i, sizeof(i)) ? NULL : "out of memory";
+		}
+		tag = 'd';
+		n = lua_tonumber(L, index);
+		return l_bufadd(b, &tag, 1) && l_bufadd(b, &n, sizeof(n)) ? NULL : "out of memory";
+	case LUA_TSTRING:
+		tag = 's';
+		str = lua_tolstring(L, index, &len);
+		return l_bufadd(b, &tag, 1) && l_bufadd(b, &len, sizeof(len))
+		       && l_bufadd(b, str, len) ? NULL : "out of memory";
+	case LUA_TTABLE:
+		if (depth >= SERIALIZEDEPTH) {
+			return "tables are nested too deeply";
+		}
+		if (!lua_checkstack(L, 3)) {
+			return "stack overflow";
+		}
+		tag = '{';
+		if (!l_bufadd(b, &tag, 1)) {
+			return "out of memory";
+		}
+		lua_pushnil(L);
+		while (lua_next(L, index)) {
+			if ((e = l_serialize(L, -2, b, depth + 1)) || (e = l_serialize(L, -1, b, depth + 1))) {
+				lua_pop(L, 2);
+				return e;
+			}
+			lua_pop(L, 1);
+		}
+		tag = '}';
+		return l_bufadd(b, &tag, 1) ? NULL : "out of memory";
+	default:
+		return "only nil, booleans, numbers, strings and tables can be passed between Lua states";
+	}
+}
+
+/* Pushes the value serialized at *p, returns 0 on malformed input */
+static int
+l_deserialize(lua_State *L, const char **p, const char *end) {
+	lua_Integer i;
+	lua_Number n;
+	size_t len;
+
+	if (*p >= end || !lua_checkstack(L, 3)) {
 		return 0;
 	}
+	switch (*(*p)++) {
+	case 'n':
+		lua_pushnil(L);
+		return 1;
+	case 't':
+	case 'f':
+		lua_pushboolean(L, (*p)[-1] == 't');
+		return 1;
+	case 'i':
+		if (end - *p < (long) sizeof(i)) {
+			return 0;
+		}
+		memcpy(&i, *p, sizeof(i));
+		*p += sizeof(i);
+		lua_pushinteger(L, i);
+		return 1;
+	case 'd':
+		if (end - *p < (long) sizeof(n)) {
+			return 0;
+		}
+		memcpy(&n, *p, sizeof(n));
+		*p += sizeof(n);
+		lua_pushnumber(L, n);
+		return 1;
+	case 's':
+		if (end - *p < (long) sizeof(len)) {
+			return 0;
+		}
+		memcpy(&len, *p, sizeof(len));
+		*p += sizeof(len);
+		if ((size_t) (end - *p) < len) {
+			return 0;
+		}
+		lua_pushlstring(L, *p, len);
+		*p += len;
+		return 1;
+	case '{':
+		lua_newtable(L);
+		while (*p < end && **p != '}') {
+			if (!l_deserialize(L, p, end) || !l_deserialize(L, p, end)) {
+				return 0;
+			}
+			lua_rawset(L, -3);
+		}
+		if (*p >= end) {
+			return 0;
+		}
+		(*p)++;
+		return 1;
+	default:
+		return 0;
+	}
+}
 
-	l_client_wrap(globalL, client);
+static void
+l_jobfree(struct l_Job *job) {
+	free(job->code.data);
+	free(job->args.data);
+	free(job);
+}
 
-	if (lua_pcall(globalL, 1, 0, 0) != LUA_OK) {
-		fprintf(stderr, "%s\n", lua_tolstring(globalL, -1, NULL));
+/* Runs jobs in a private Lua state without access to the dwm module */
+static void *
+l_worker(void *arg) {
+	lua_State *L;
+	struct l_Job *job;
+	const char *p, *e;
+	int i, top;
+
+	if (!(L = luaL_newstate())) {
+		errx(1, "can't create Lua state for worker");
+	}
+	luaL_openlibs(L);
+
+	for (;;) {
+		pthread_mutex_lock(&jobslock);
+		while (!jobs) {
+			pthread_cond_wait(&jobscond, &jobslock);
+		}
+		job = jobs;
+		if (!(jobs = job->next)) {
+			jobstail = &jobs;
+		}
+		pthread_mutex_unlock(&jobslock);
+
+		lua_settop(L, 0);
+		job->ok = luaL_loadbufferx(L, job->code.data, job->code.len, "=worker", "b") == LUA_OK;
+		p = job->args.data;
+		for (i = 0; job->ok && i < job->nargs; i++) {
+			if (!l_deserialize(L, &p, job->args.data + job->args.len)) {
+				lua_settop(L, 0);
+				lua_pushliteral(L, "malformed worker arguments");
+				job->ok = 0;
+			}
+		}
+		if (job->ok) {
+			job->ok = lua_pcall(L, job->nargs, LUA_MULTRET, 0) == LUA_OK;
+		}
+
+		/* Results, or the error message, replace the arguments */
+		job->args.len = 0;
+		top = lua_gettop(L);
+		for (i = 1; i <= top; i++) {
+			if ((e = l_serialize(L, i, &job->args, 0))) {
+				job->args.len = 0;
+				job->ok = 0;
+				lua_pushstring(L, e);
+				l_serialize(L, -1, &job->args, 0);
+				top = 1;
+				break;
+			}
+		}
+		job->nargs = top;
+		job->next = NULL;
+
+		pthread_mutex_lock(&jobslock);
+		*donejobstail = job;
+		donejobstail = &job->next;
+		pthread_mutex_unlock(&jobslock);
+		while (write(workerpipe[1], "", 1) == -1 && errno == EINTR);
+	}
+
+	return NULL;
+}
+
+static int
+l_startworkers(void) {
+	pthread_t thread;
+	int i;
+
+	if (pipe(workerpipe) == -1) {
 		return 0;
 	}
+	fcntl(workerpipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(workerpipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(workerpipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(workerpipe[1], F_SETFD, FD_CLOEXEC);
+
+	for (i = 0; i < NWORKERS; i++) {
+		if (pthread_create(&thread, NULL, l_worker, NULL) != 0) {
+			return i > 0;
+		}
+		pthread_detach(thread);
+	}
 
 	return 1;
 }
+
+/* dwm.worker.run(fn, callback, ...) runs fn(...) in a worker state and
+ * calls callback(ok, results...) on the main thread when it's done */
+static int
+l_u_worker_run(lua_State *L) {
+	struct l_Job *job;
+	const char *name, *e;
+	int i;
+
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	if (lua_iscfunction(L, 1)) {
+		return luaL_error(L, "Can't run C functions in a worker");
+	}
+	for (i = 1; (name = lua_getupvalue(L, 1, i)); i++) {
+		lua_pop(L, 1);
+		if (strcmp(name, "_ENV")) {
+			return luaL_error(L, "Worker functions can't have upvalues (%s)", name);
+		}
+	}
+
+	if (workerpipe[0] == -1 && !l_startworkers()) {
+		return luaL_error(L, "Can't start worker threads");
+	}
+	if (!(job = calloc(1, sizeof(*job)))) {
+		return luaL_error(L, "Can't allocate worker job");
+	}
+
+	lua_pushvalue(L, 1);
+	if (lua_dump(L, l_bufwriter, &job->code, 0) != 0) {
+		l_jobfree(job);
+		return luaL_error(L, "Can't dump worker function");
+	}
+	lua_pop(L, 1);
+
+	job->nargs = lua_gettop(L) - 2;
+	for (i = 3; i <= lua_gettop(L); i++) {
+		if ((e = l_serialize(L, i, &job->args, 0))) {
+			l_jobfree(job);
+			return luaL_error(L, "Argument %d: %s", i - 2, e);
+		}
+	}
+
+	lua_pushvalue(L, 2);
+	job->callback = luaL_ref(L, LUA_REGISTRYINDEX);
+	job->gen = workergen;
+
+	pthread_mutex_lock(&jobslock);
+	*jobstail = job;
+	jobstail = &job->next;
+	pthread_cond_signal(&jobscond);
+	pthread_mutex_unlock(&jobslock);
+
+	return 0;
+}
+
+/* Hands the results of finished jobs to their callbacks */
+static void
+l_finishjobs(void) {
+	struct l_Job *job, *next;
+	const char *p;
+	char buf[64];
+	int i;
+
+	if (workerpipe[0] == -1) {
+		return;
+	}
+	while (read(workerpipe[0], buf, sizeof(buf)) > 0);
+
+	pthread_mutex_lock(&jobslock);
+	job = donejobs;
+	donejobs = NULL;
+	donejobstail = &donejobs;
+	pthread_mutex_unlock(&jobslock);
+
+	for (; job; job = next) {
+		next = job->next;
+		if (job->gen == workergen) {
+			lua_pushboolean(globalL, job->ok);
+			p = job->args.data;
+			for (i = 0; i < job->nargs; i++) {
+				if (!l_deserialize(globalL, &p, job->args.data + job->args.len)) {
+					lua_pushnil(globalL);
+				}
+			}
+			l_pcall(HookWorker, job->callback, job->nargs + 1, 0);
+		}
+		l_unref(job->callback);
+		l_jobfree(job);
+	}
+}
+
+int
+l_workerfd(void) {
+	return workerpipe[0];
+}
+
+int
+l_timeout(void) {
+	long long now;
+
+	if (!globalL)
+		return -1;
+	if (ndeferred > 0 || bardirty)
+		return 0;
+	if (ntimers == 0)
+		return -1;
+
+	now = l_now();
+	if (timers[0].deadline <= now)
+		return 0;
+	return (int) MIN(timers[0].deadline - now, 60 * 1000);
+}
+
+int
+l_dispatch(void) {
+	struct l_Timer t;
+	long long now;
+	size_t cap;
+	int *batch, ref, redraw;
+
+	if (!globalL) {
+		return 0;
+	}
+
+	l_finishjobs();
+
+	/* Callbacks deferred while running these go to the next dispatch */
+	batch = deferredrun;
+	cap = deferredruncap;
+	deferredrun = deferred;
+	deferredruncap = deferredcap;
+	ndeferredrun = ndeferred;
+	deferred = batch;
+	deferredcap = cap;
+	ndeferred = 0;
+	for (deferrednext = 0; deferrednext < ndeferredrun;) {
+		ref = deferredrun[deferrednext++];
+		l_pcall(HookDefer, ref, 0, 0);
+		luaL_unref(globalL, LUA_REGISTRYINDEX, ref);
+	}
+	ndeferredrun = deferrednext = 0;
+
+	now = l_now();
+	while (ntimers > 0 && timers[0].deadline <= now) {
+		t = timers[0];
+		l_timer_remove(0);
+
+		runningtimer = t.id;
+		runningcancelled = 0;
+		runningstrikes = t.strikes;
+		if (l_pcall(HookTimer, t.ref, 0, 1)) {
+			/* Repeating timers stop once their callback returns false */
+			if (lua_isboolean(globalL, -1) && !lua_toboolean(globalL, -1))
+				runningcancelled = 1;
+			lua_pop(globalL, 1);
+		}
+		t.strikes = runningstrikes;
+		runningtimer = 0;
+
+		if (!t.interval || runningcancelled) {
+			luaL_unref(globalL, LUA_REGISTRYINDEX, t.ref);
+			continue;
+		}
+
+		/* Don't try to catch up on missed intervals */
+		t.deadline += t.interval;
+		if (t.deadline <= now)
+			t.deadline = now + t.interval;
+		l_timer_push(&t);
+	}
+
+	redraw = bardirty;
+	bardirty = 0;
+	return redraw;
+}
@@ -4,10 +4,19 @@
 
 int l_call_client_click(int, int, Client *);
 int l_call_client_new(Client *);
-int l_call_keypress(unsigned int, KeySym);
+int l_call_keypress(int, int, unsigned int);
+int l_call_layout(int, const LayoutArgs *, int, Geom *);
 int l_call_status_click(int, int);
 int l_call_status_drawfn(int, int, int);
 int l_call_tag_click(int, int, int);
+int l_collect(void);
+int l_dispatch(void);
+int l_keyname(KeySym);
+int l_timeout(void);
+int l_workerfd(void);
 
+void l_client_changed(Client *);
+void l_client_unmanage(Client *);
 void l_init();
 void l_loadconfig();
+void l_unref(int);
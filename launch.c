@@ -0,0 +1,453 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Programs are started by a launcher process which is forked before dwm
+ * connects to X or creates its Lua state, so it stays small. dwm sends it
+ * the command over a socketpair and the launcher starts it with
+ * posix_spawnp. If the launcher is gone, dwm falls back to forking itself.
+ *
+ * The launcher reaps its children and reports their exits over the same
+ * socket, dwm reads these reports from its event loop.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "launch.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#define MAXREQUEST 65536
+
+typedef struct {
+	unsigned int len, argc, envc; /* followed by cwd, argv and env, NUL-separated */
+} Request;
+
+enum { MsgSpawned, MsgExited }; /* launcher messages */
+
+typedef struct {
+	int kind;
+	pid_t pid;
+	int val; /* errno value for MsgSpawned, wait status for MsgExited */
+} Message;
+
+extern char **environ;
+
+LaunchStats launch_stats;
+static LaunchProc procs[LAUNCH_MAXPROCS];
+static unsigned long nlaunched = 0;
+static int sock = -1;
+static int chldpipe[2] = { -1, -1 }; /* launcher only */
+
+static double
+now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int
+readall(int fd, void *buf, size_t len) {
+	char *p = buf;
+	ssize_t n;
+
+	while(len) {
+		if((n = read(fd, p, len)) <= 0) {
+			if(n == -1 && errno == EINTR)
+				continue;
+			return 0;
+		}
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int
+sendall(int fd, const void *buf, size_t len) {
+	const char *p = buf;
+	ssize_t n;
+
+	while(len) {
+		if((n = send(fd, p, len, MSG_NOSIGNAL)) == -1) {
+			if(errno == EINTR)
+				continue;
+			return 0;
+		}
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/* Returns environ with env applied, only the array must be freed */
+static char **
+mergeenv(char *const env[]) {
+	size_t i, j, k, n, m, len;
+	char **merged;
+
+	for(n = 0; environ[n]; n++);
+	for(m = 0; env && env[m]; m++);
+	if(!(merged = malloc((n + m + 1) * sizeof(char *))))
+		return NULL;
+	for(i = k = 0; i < n; i++) {
+		for(j = 0; j < m; j++) {
+			len = strcspn(env[j], "=");
+			if(!strncmp(environ[i], env[j], len) && environ[i][len] == '=')
+				break;
+		}
+		if(j == m)
+			merged[k++] = environ[i];
+	}
+	for(j = 0; j < m; j++)
+		if(strchr(env[j], '='))
+			merged[k++] = env[j];
+	merged[k] = NULL;
+	return merged;
+}
+
+/* Runs in the launcher, returns 0 or an errno value */
+static int
+spawnv(char *const argv[], char *const env[], const char *cwd, pid_t *pid) {
+	posix_spawnattr_t attr;
+	sigset_t none, dfl;
+	char **envp;
+	int dir = -1, err;
+
+	if(!(envp = mergeenv(env)))
+		return ENOMEM;
+	/* posix_spawn has no portable way to set the working directory, but
+	 * the launcher is single-threaded, so it can change its own */
+	if(*cwd && ((dir = open(".", O_RDONLY)) == -1 || chdir(cwd) == -1)) {
+		err = errno;
+		if(dir != -1)
+			close(dir);
+		free(envp);
+		return err;
+	}
+
+	sigemptyset(&none);
+	sigemptyset(&dfl);
+	sigaddset(&dfl, SIGCHLD);
+	sigaddset(&dfl, SIGPIPE);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &none);
+	posix_spawnattr_setsigdefault(&attr, &dfl);
+#ifdef POSIX_SPAWN_SETSID
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID
+	                         | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+#else
+	posix_spawnattr_setpgroup(&attr, 0);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP
+	                         | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+#endif
+	err = posix_spawnp(pid, argv[0], NULL, &attr, argv, envp);
+	posix_spawnattr_destroy(&attr);
+
+	if(dir != -1) {
+		if(fchdir(dir) == -1)
+			perror("dwm: launcher: fchdir");
+		close(dir);
+	}
+	free(envp);
+	return err;
+}
+
+static void
+launchersigchld(int unused) {
+	int e = errno;
+
+	while(write(chldpipe[1], "", 1) == -1 && errno == EINTR);
+	errno = e;
+}
+
+/* Reports the exits of all children that are gone */
+static int
+launcherreap(int fd) {
+	Message msg;
+	char buf[64];
+
+	while(read(chldpipe[0], buf, sizeof buf) > 0);
+	msg.kind = MsgExited;
+	while((msg.pid = waitpid(-1, &msg.val, WNOHANG)) > 0)
+		if(!sendall(fd, &msg, sizeof msg))
+			return 0;
+	return 1;
+}
+
+static void
+launcher(int fd) {
+	Request req;
+	Message msg;
+	struct pollfd pfd[2];
+	char *buf, *p, **argv;
+	unsigned int i;
+
+	if(pipe(chldpipe) == -1)
+		_exit(EXIT_FAILURE);
+	fcntl(chldpipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(chldpipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(chldpipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(chldpipe[1], F_SETFD, FD_CLOEXEC);
+	signal(SIGCHLD, launchersigchld);
+
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = chldpipe[0];
+	pfd[1].events = POLLIN;
+	for(;;) {
+		if(poll(pfd, 2, -1) == -1) {
+			if(errno == EINTR)
+				continue;
+			_exit(EXIT_FAILURE);
+		}
+		if(pfd[1].revents & POLLIN && !launcherreap(fd))
+			break;
+		if(!(pfd[0].revents & (POLLIN | POLLHUP)))
+			continue;
+		if(!readall(fd, &req, sizeof req))
+			break;
+		if(req.len > MAXREQUEST || req.argc == 0 || req.argc + req.envc >= req.len)
+			_exit(EXIT_FAILURE);
+		if(!(buf = malloc(req.len))
+		|| !(argv = calloc(req.argc + req.envc + 2, sizeof(char *))))
+			_exit(EXIT_FAILURE);
+		if(!readall(fd, buf, req.len) || buf[req.len - 1] != '\0')
+			_exit(EXIT_FAILURE);
+		/* argv and env share the array, separated by a NULL */
+		p = buf + strlen(buf) + 1;
+		for(i = 0; i < req.argc + req.envc; i++) {
+			if(p >= buf + req.len)
+				_exit(EXIT_FAILURE);
+			argv[i < req.argc ? i : i + 1] = p;
+			p += strlen(p) + 1;
+		}
+		msg.kind = MsgSpawned;
+		msg.pid = -1;
+		msg.val = spawnv(argv, argv + req.argc + 1, buf, &msg.pid);
+		free(argv);
+		free(buf);
+		if(!sendall(fd, &msg, sizeof msg))
+			break;
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+/* Used when there is no launcher, the way dwm always used to do it */
+static int
+forkspawn(char *const argv[], char *const env[], const char *cwd, pid_t *pid) {
+	switch((*pid = fork())) {
+	case -1:
+		return errno;
+	case 0:
+		setsid();
+		if(*cwd && chdir(cwd) == -1) {
+			fprintf(stderr, "dwm: chdir(): %s", cwd);
+			perror(" failed");
+			_exit(EXIT_FAILURE);
+		}
+		for(; env && *env; env++) {
+			if(strchr(*env, '='))
+				putenv(*env);
+			else
+				unsetenv(*env);
+		}
+		execvp(argv[0], argv);
+		fprintf(stderr, "dwm: execvp(): %s", argv[0]);
+		perror(" failed");
+		_exit(EXIT_SUCCESS);
+	}
+	return 0;
+}
+
+void
+launch_init(void) {
+	int sv[2];
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		perror("dwm: socketpair");
+		return;
+	}
+	switch(fork()) {
+	case -1:
+		perror("dwm: fork");
+		close(sv[0]);
+		close(sv[1]);
+		return;
+	case 0:
+		close(sv[0]);
+		fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+		launcher(sv[1]);
+	}
+	close(sv[1]);
+	fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+	sock = sv[0];
+}
+
+/* Returns a slot for a new launch: a free or stale one, or the oldest */
+static LaunchProc *
+newproc(double t) {
+	LaunchProc *p, *oldest = &procs[0];
+
+	for(p = procs; p < procs + LAUNCH_MAXPROCS; p++) {
+		if(!p->pid || t - p->started > LAUNCH_TIMEOUT)
+			return p;
+		if(p->started < oldest->started)
+			oldest = p;
+	}
+	return oldest;
+}
+
+static void
+handle(Message *msg) {
+	if(msg->kind == MsgExited)
+		launch_exited(msg->pid, msg->val);
+}
+
+/* Waits for the launcher's answer to a spawn request */
+static int
+awaitspawn(Message *msg) {
+	do {
+		if(!readall(sock, msg, sizeof *msg))
+			return 0;
+		handle(msg);
+	} while(msg->kind != MsgSpawned);
+	return 1;
+}
+
+LaunchProc *
+launch_spawn(char *const argv[], char *const env[], const char *cwd) {
+	Request req;
+	Message msg;
+	LaunchProc *proc;
+	char *buf, *p, startupid[sizeof(proc->startupid)], envid[sizeof(startupid) + 32];
+	char **envp;
+	unsigned int i;
+	double start = now(), t;
+
+	if(!cwd)
+		cwd = "";
+	for(req.argc = 0; argv[req.argc]; req.argc++);
+	for(req.envc = 0; env && env[req.envc]; req.envc++);
+	if(req.argc == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* toolkits put this on their first window as _NET_STARTUP_ID */
+	snprintf(startupid, sizeof startupid, "dwm-gbe-%ld-%lu_TIME%ld",
+	         (long)getpid(), ++nlaunched, (long)time(NULL));
+	snprintf(envid, sizeof envid, "DESKTOP_STARTUP_ID=%s", startupid);
+	if(!(envp = malloc((req.envc + 2) * sizeof(char *))))
+		return NULL;
+	for(i = 0; i < req.envc; i++)
+		envp[i] = env[i];
+	envp[req.envc++] = envid;
+	envp[req.envc] = NULL;
+
+	req.len = strlen(cwd) + 1;
+	for(i = 0; i < req.argc; i++)
+		req.len += strlen(argv[i]) + 1;
+	for(i = 0; i < req.envc; i++)
+		req.len += strlen(envp[i]) + 1;
+
+	if(sock != -1 && req.len <= MAXREQUEST && (buf = malloc(req.len))) {
+		p = buf + strlen(strcpy(buf, cwd)) + 1;
+		for(i = 0; i < req.argc; i++)
+			p += strlen(strcpy(p, argv[i])) + 1;
+		for(i = 0; i < req.envc; i++)
+			p += strlen(strcpy(p, envp[i])) + 1;
+		if(!sendall(sock, &req, sizeof req) || !sendall(sock, buf, req.len)
+		|| !awaitspawn(&msg)) {
+			/* the launcher is gone, fork from now on */
+			close(sock);
+			sock = -1;
+			msg.val = forkspawn(argv, envp, cwd, &msg.pid);
+		}
+		free(buf);
+	} else
+		msg.val = forkspawn(argv, envp, cwd, &msg.pid);
+	free(envp);
+
+	t = now() - start;
+	launch_stats.latency = t;
+	launch_stats.totallatency += t;
+	if(t > launch_stats.maxlatency)
+		launch_stats.maxlatency = t;
+	if(msg.val) {
+		launch_stats.failed++;
+		errno = msg.val;
+		return NULL;
+	}
+	launch_stats.spawned++;
+
+	proc = newproc(start);
+	memset(proc, 0, sizeof *proc);
+	proc->pid = msg.pid;
+	proc->started = start;
+	strcpy(proc->startupid, startupid);
+	return proc;
+}
+
+LaunchProc *
+launch_match(pid_t pid, const char *startupid) {
+	LaunchProc *p, *match = NULL;
+	double t = now();
+
+	for(p = procs; p < procs + LAUNCH_MAXPROCS; p++) {
+		if(!p->pid || t - p->started > LAUNCH_TIMEOUT)
+			continue;
+		/* the startup id survives shell wrappers, the pid doesn't */
+		if(startupid && *startupid && !strcmp(p->startupid, startupid))
+			return p;
+		if(pid > 0 && p->pid == pid)
+			match = p;
+	}
+	return match;
+}
+
+void
+launch_exited(pid_t pid, int status) {
+	LaunchProc *p;
+
+	for(p = procs; p < procs + LAUNCH_MAXPROCS; p++) {
+		if(p->pid == pid && !p->exited) {
+			launch_stats.exited++;
+			p->exited = 1;
+			p->status = status;
+			return;
+		}
+	}
+}
+
+int
+launch_fd(void) {
+	return sock;
+}
+
+void
+launch_dispatch(void) {
+	struct pollfd pfd;
+	Message msg;
+
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	while(sock != -1 && poll(&pfd, 1, 0) > 0) {
+		if(!readall(sock, &msg, sizeof msg)) {
+			close(sock);
+			sock = -1;
+			return;
+		}
+		handle(&msg);
+	}
+}
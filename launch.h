@@ -0,0 +1,39 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef _LAUNCH_H
+#define _LAUNCH_H
+#include <sys/types.h>
+
+typedef struct {
+	unsigned long spawned, failed, exited;
+	double latency, maxlatency, totallatency; /* request round trips in ms */
+} LaunchStats;
+
+/* A program started by launch_spawn. The caller records where it was
+ * launched, so that its windows can be placed there. */
+typedef struct {
+	pid_t pid;              /* 0 if the slot is unused */
+	double started;         /* CLOCK_MONOTONIC, in ms */
+	char startupid[64];     /* DESKTOP_STARTUP_ID passed to the program */
+	int exited, status;     /* wait status once the program has exited */
+	int mon;                /* placement, set by the caller */
+	unsigned int tags;
+} LaunchProc;
+
+#define LAUNCH_MAXPROCS 64
+#define LAUNCH_TIMEOUT  30000 /* ms during which windows are matched to a launch */
+
+extern LaunchStats launch_stats;
+
+/* Forks the launcher, must be called while dwm is still small */
+void launch_init(void);
+/* env holds "NAME=value" to set and "NAME" to unset, cwd may be NULL.
+ * Returns NULL and sets errno on failure. */
+LaunchProc *launch_spawn(char *const argv[], char *const env[], const char *cwd);
+/* Finds the launch a new window belongs to, by startup id or pid */
+LaunchProc *launch_match(pid_t pid, const char *startupid);
+/* Records the exit of a child forked by dwm itself */
+void launch_exited(pid_t pid, int status);
+/* The launcher socket, readable when the launcher has news */
+int launch_fd(void);
+void launch_dispatch(void);
+#endif /* _LAUNCH_H */
@@ -0,0 +1,158 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Layouts turn the number of tiled clients and the work area of a monitor
+ * into one geometry per client. They don't see the clients themselves, so
+ * their results only depend on the arguments and are kept per monitor
+ * until these change. Size hints are applied by the caller.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "layout.h"
+#include "l.h"
+#include "util.h"
+
+static Bool tile(const LayoutArgs *a, int n, Geom *g);
+static Bool monocle(const LayoutArgs *a, int n, Geom *g);
+static Bool grid(const LayoutArgs *a, int n, Geom *g);
+
+static Layout layouts[MAXLAYOUTS] = {
+	{ "[]=", tile,    0, False },
+	{ "[M]", monocle, 0, False },
+	{ "###", grid,    0, False },
+};
+#define NBUILTIN 3
+static int nlayouts = NBUILTIN;
+static unsigned int gen = 1; /* bumped when Lua layouts change */
+
+Bool
+tile(const LayoutArgs *a, int n, Geom *g) {
+	int i, h, mw, my, ty;
+
+	if(n > a->nmaster)
+		mw = a->nmaster ? a->area.w * a->mfact : 0;
+	else
+		mw = a->area.w;
+	for(i = my = ty = 0; i < n; i++)
+		if(i < a->nmaster) {
+			h = MAX(1, (a->area.h - my) / (MIN(n, a->nmaster) - i));
+			g[i].x = a->area.x;
+			g[i].y = a->area.y + my;
+			g[i].w = mw;
+			g[i].h = h;
+			my += h;
+		} else {
+			h = MAX(1, (a->area.h - ty) / (n - i));
+			g[i].x = a->area.x + mw;
+			g[i].y = a->area.y + ty;
+			g[i].w = a->area.w - mw;
+			g[i].h = h;
+			ty += h;
+		}
+	return True;
+}
+
+Bool
+monocle(const LayoutArgs *a, int n, Geom *g) {
+	while(n--)
+		g[n] = a->area;
+	return True;
+}
+
+/* Columns of equal width, the last n % cols columns hold one more client */
+Bool
+grid(const LayoutArgs *a, int n, Geom *g) {
+	int i, col, row, cols, rows, x, w;
+
+	for(cols = 1; cols * cols < n; cols++);
+	for(i = col = 0; col < cols; col++) {
+		rows = n / cols + (col >= cols - n % cols);
+		x = a->area.x + a->area.w * col / cols;
+		w = a->area.x + a->area.w * (col + 1) / cols - x;
+		for(row = 0; row < rows; row++, i++) {
+			g[i].x = x;
+			g[i].w = w;
+			g[i].y = a->area.y + a->area.h * row / rows;
+			g[i].h = a->area.y + a->area.h * (row + 1) / rows - g[i].y;
+		}
+	}
+	return True;
+}
+
+int
+layout_register(const char *symbol, int ref) {
+	int i;
+
+	if((i = layout_find(symbol)) == -1) {
+		if(nlayouts == MAXLAYOUTS)
+			return -1;
+		i = nlayouts++;
+		strncpy(layouts[i].symbol, symbol, sizeof layouts[i].symbol - 1);
+	} else if(layouts[i].arrange)
+		return -1;
+	layouts[i].ref = ref;
+	layouts[i].broken = False;
+	gen++;
+	return i;
+}
+
+void
+layout_reset(void) {
+	memset(&layouts[NBUILTIN], 0, (nlayouts - NBUILTIN) * sizeof(Layout));
+	nlayouts = NBUILTIN;
+	gen++;
+}
+
+const Layout *
+layout_get(int i) {
+	return i >= 0 && i < nlayouts ? &layouts[i] : NULL;
+}
+
+int
+layout_count(void) {
+	return nlayouts;
+}
+
+int
+layout_find(const char *symbol) {
+	int i;
+
+	for(i = 0; i < nlayouts; i++)
+		if(!strncmp(layouts[i].symbol, symbol, sizeof layouts[i].symbol - 1))
+			return i;
+	return -1;
+}
+
+const Geom *
+layout_arrange(int i, const LayoutArgs *a, int n, LayoutCache *lc) {
+	Bool ok;
+
+	if(i < 0 || i >= nlayouts)
+		i = 0;
+	if(layouts[i].broken)
+		return NULL;
+	if(lc->layout == i && lc->n == n && lc->gen == gen
+	&& lc->args.mfact == a->mfact && lc->args.nmaster == a->nmaster
+	&& !memcmp(&lc->args.area, &a->area, sizeof(Geom)))
+		return lc->g;
+	if(n > lc->cap) {
+		lc->cap = n;
+		lc->g = erealloc(lc->g, lc->cap * sizeof(Geom));
+	}
+	if(layouts[i].arrange)
+		ok = layouts[i].arrange(a, n, lc->g);
+	else
+		ok = l_call_layout(layouts[i].ref, a, n, lc->g);
+	if(!ok) {
+		fprintf(stderr, "dwm: layout %s failed, disabling it\n", layouts[i].symbol);
+		layouts[i].broken = True;
+		lc->gen = 0; /* gen is never 0, so this is recomputed next time */
+		return NULL;
+	}
+	lc->layout = i;
+	lc->n = n;
+	lc->gen = gen;
+	lc->args = *a;
+	return lc->g;
+}
@@ -0,0 +1,51 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef _LAYOUT_H
+#define _LAYOUT_H
+#include <X11/Xlib.h>
+
+#define MAXLAYOUTS 32
+
+/* Outer geometry of a client, borders included */
+typedef struct {
+	int x, y, w, h;
+} Geom;
+
+/* What a layout gets besides the number of clients */
+typedef struct {
+	Geom area;
+	float mfact;
+	int nmaster;
+} LayoutArgs;
+
+typedef struct {
+	char symbol[16];
+	/* Fills g with n geometries, returns False on failure. NULL for layouts
+	 * written in Lua, which are called through ref. */
+	Bool (*arrange)(const LayoutArgs *a, int n, Geom *g);
+	int ref;
+	Bool broken; /* failed once, not called until registered again */
+} Layout;
+
+/* The last geometries computed for a monitor and what they depend on */
+typedef struct {
+	int layout, n;
+	unsigned int gen;
+	LayoutArgs args;
+	Geom *g;
+	int cap;
+} LayoutCache;
+
+/* Adds a Lua layout or replaces the one with the same symbol. Returns its
+ * index, -1 if there are too many or symbol names a built-in layout. */
+int layout_register(const char *symbol, int ref);
+/* Drops all Lua layouts */
+void layout_reset(void);
+const Layout *layout_get(int i);
+int layout_count(void);
+/* Returns the index of the layout with this symbol, or -1 */
+int layout_find(const char *symbol);
+/* Returns n geometries from layout i, recomputed only if i, n or a differ
+ * from the last call with lc. NULL if the layout failed, or failed before
+ * and hasn't been registered again since. */
+const Geom *layout_arrange(int i, const LayoutArgs *a, int n, LayoutCache *lc);
+#endif /* _LAYOUT_H */
@@ -0,0 +1,318 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Rules are compiled into lookup structures the first time a window is
+ * matched after they changed. Like in suckless dwm, class, instance and title
+ * patterns match any part of the window's strings. All patterns of a field
+ * are searched at once by an Aho-Corasick automaton. Exact class and
+ * instance rules are found through hash tables instead. The rules a window
+ * matches are the intersection of the three sets.
+ */
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dwm.h"
+#include "util.h"
+
+#define NBUCKETS   64
+#define NWORDS     LENGTH(((RuleSet *)0)->bits)
+#define BITS       (8 * sizeof(unsigned long))
+#define SETBIT(s,i)  ((s)->bits[(i) / BITS] |= 1UL << ((i) % BITS))
+#define HASBIT(s,i)  ((s)->bits[(i) / BITS] & (1UL << ((i) % BITS)))
+
+typedef struct Entry Entry;
+struct Entry {
+	char *str;
+	unsigned int hash;
+	RuleSet set;
+	Entry *next;
+};
+
+typedef struct {
+	Entry *buckets[NBUCKETS];
+	RuleSet any; /* rules without a string to match */
+} Table;
+
+typedef struct {
+	unsigned char ch;
+	int to, next;
+} Edge;
+
+typedef struct {
+	int fail;  /* longest proper suffix that is also a state */
+	int edges; /* first outgoing edge, -1 if none */
+	Bool out;  /* set isn't empty */
+	RuleSet set;
+} State;
+
+typedef struct {
+	State *states;
+	Edge *edges;
+	int nstates, statecap, nedges, edgecap;
+	RuleSet any; /* rules with an empty pattern or none */
+} Automaton;
+
+static Rule rules[MAXRULES];
+static int nrules = 0;
+static Bool dirty = True;
+
+static Table classes, instances;          /* exact rules */
+static Automaton classpats, instancepats; /* substring rules */
+static Automaton titles;
+
+static char *
+estrdup(const char *s) {
+	char *p;
+
+	if(!s)
+		return NULL;
+	if(!(p = strdup(s)))
+		errx(1, "fatal: could not malloc() %zu bytes", strlen(s) + 1);
+	return p;
+}
+
+static void
+setor(RuleSet *a, const RuleSet *b) {
+	unsigned int i;
+
+	for(i = 0; i < NWORDS; i++)
+		a->bits[i] |= b->bits[i];
+}
+
+static void
+tableclear(Table *t) {
+	Entry *e, *next;
+	unsigned int i;
+
+	for(i = 0; i < NBUCKETS; i++) {
+		for(e = t->buckets[i]; e; e = next) {
+			next = e->next;
+			free(e);
+		}
+		t->buckets[i] = NULL;
+	}
+	memset(&t->any, 0, sizeof t->any);
+}
+
+static Entry *
+tableget(Table *t, const char *s, unsigned int hash, Bool create) {
+	Entry *e;
+
+	for(e = t->buckets[hash % NBUCKETS]; e; e = e->next)
+		if(e->hash == hash && !strcmp(e->str, s))
+			return e;
+	if(!create)
+		return NULL;
+	e = ecalloc(1, sizeof(Entry));
+	e->str = (char *)s; /* owned by the rule */
+	e->hash = hash;
+	e->next = t->buckets[hash % NBUCKETS];
+	t->buckets[hash % NBUCKETS] = e;
+	return e;
+}
+
+static void
+tableadd(Table *t, const char *s, int rule) {
+	if(s)
+		SETBIT(&tableget(t, s, strhash(s), True)->set, rule);
+	else
+		SETBIT(&t->any, rule);
+}
+
+static void
+tablematch(Table *t, const char *s, unsigned int hash, RuleSet *set) {
+	Entry *e;
+
+	*set = t->any;
+	if((e = tableget(t, s, hash, False)))
+		setor(set, &e->set);
+}
+
+static int
+newstate(Automaton *a) {
+	if(a->nstates == a->statecap) {
+		a->statecap = a->statecap ? a->statecap * 2 : 64;
+		a->states = erealloc(a->states, a->statecap * sizeof(State));
+	}
+	memset(&a->states[a->nstates], 0, sizeof(State));
+	a->states[a->nstates].edges = -1;
+	return a->nstates++;
+}
+
+static int
+step(const Automaton *a, int s, unsigned char ch) {
+	int e;
+
+	for(e = a->states[s].edges; e != -1; e = a->edges[e].next)
+		if(a->edges[e].ch == ch)
+			return a->edges[e].to;
+	return -1;
+}
+
+static int
+addedge(Automaton *a, int s, unsigned char ch) {
+	int to = newstate(a);
+
+	if(a->nedges == a->edgecap) {
+		a->edgecap = a->edgecap ? a->edgecap * 2 : 64;
+		a->edges = erealloc(a->edges, a->edgecap * sizeof(Edge));
+	}
+	a->edges[a->nedges].ch = ch;
+	a->edges[a->nedges].to = to;
+	a->edges[a->nedges].next = a->states[s].edges;
+	a->states[s].edges = a->nedges;
+	a->nedges++;
+	return to;
+}
+
+static void
+acclear(Automaton *a) {
+	a->nstates = a->nedges = 0;
+	memset(&a->any, 0, sizeof a->any);
+	newstate(a);
+}
+
+static void
+acadd(Automaton *a, const char *pattern, int rule) {
+	const unsigned char *p;
+	int s, t;
+
+	if(!pattern || !*pattern) {
+		SETBIT(&a->any, rule);
+		return;
+	}
+	for(s = 0, p = (const unsigned char *)pattern; *p; p++)
+		s = (t = step(a, s, *p)) != -1 ? t : addedge(a, s, *p);
+	SETBIT(&a->states[s].set, rule);
+	a->states[s].out = True;
+}
+
+/* Links every state to its fail state, after all patterns are added */
+static void
+acbuild(Automaton *a) {
+	int s, t, e, f, *queue, head, tail;
+	State *st = a->states;
+
+	/* breadth first, so the fail state of a state is done before it */
+	queue = ecalloc(a->nstates, sizeof(int));
+	head = tail = 0;
+	for(e = st[0].edges; e != -1; e = a->edges[e].next)
+		queue[tail++] = a->edges[e].to;
+	while(head < tail) {
+		s = queue[head++];
+		for(e = st[s].edges; e != -1; e = a->edges[e].next) {
+			t = a->edges[e].to;
+			for(f = st[s].fail; f && step(a, f, a->edges[e].ch) == -1; f = st[f].fail);
+			f = step(a, f, a->edges[e].ch);
+			st[t].fail = f != -1 && f != t ? f : 0;
+			if(st[st[t].fail].out) {
+				setor(&st[t].set, &st[st[t].fail].set);
+				st[t].out = True;
+			}
+			queue[tail++] = t;
+		}
+	}
+	free(queue);
+}
+
+/* Adds the rules whose pattern occurs in str to set */
+static void
+acmatch(const Automaton *a, const char *str, RuleSet *set) {
+	const unsigned char *p;
+	int s, t;
+
+	setor(set, &a->any);
+	for(s = 0, p = (const unsigned char *)str; *p; p++) {
+		while((t = step(a, s, *p)) == -1 && s)
+			s = a->states[s].fail;
+		s = t != -1 ? t : 0;
+		if(a->states[s].out)
+			setor(set, &a->states[s].set);
+	}
+}
+
+static void
+compile(void) {
+	int i;
+
+	tableclear(&classes);
+	tableclear(&instances);
+	acclear(&classpats);
+	acclear(&instancepats);
+	acclear(&titles);
+	for(i = 0; i < nrules; i++) {
+		if(rules[i].exact) {
+			tableadd(&classes, rules[i].class, i);
+			tableadd(&instances, rules[i].instance, i);
+		} else {
+			acadd(&classpats, rules[i].class, i);
+			acadd(&instancepats, rules[i].instance, i);
+		}
+		acadd(&titles, rules[i].title, i);
+	}
+	acbuild(&classpats);
+	acbuild(&instancepats);
+	acbuild(&titles);
+	dirty = False;
+}
+
+int
+rule_add(const Rule *r) {
+	if(nrules == MAXRULES)
+		return -1;
+	rules[nrules] = *r;
+	rules[nrules].class = estrdup(r->class);
+	rules[nrules].instance = estrdup(r->instance);
+	rules[nrules].title = estrdup(r->title);
+	dirty = True;
+	return nrules++;
+}
+
+void
+rule_truncate(int n) {
+	while(nrules > n) {
+		nrules--;
+		free((char *)rules[nrules].class);
+		free((char *)rules[nrules].instance);
+		free((char *)rules[nrules].title);
+	}
+	dirty = True;
+}
+
+const Rule *
+rule_get(int i) {
+	return i >= 0 && i < nrules ? &rules[i] : NULL;
+}
+
+Bool
+rule_hastitles(void) {
+	if(dirty)
+		compile();
+	return titles.nstates > 1;
+}
+
+void
+rule_match(const char *class, unsigned int classhash, const char *instance,
+           const char *title, RuleSet *set) {
+	RuleSet in, ti;
+	unsigned int i;
+
+	if(dirty)
+		compile();
+	tablematch(&classes, class, classhash, set);
+	acmatch(&classpats, class, set);
+	tablematch(&instances, instance, strhash(instance), &in);
+	acmatch(&instancepats, instance, &in);
+	memset(&ti, 0, sizeof ti);
+	acmatch(&titles, title, &ti);
+	for(i = 0; i < NWORDS; i++)
+		set->bits[i] &= in.bits[i] & ti.bits[i];
+}
+
+int
+rule_next(const RuleSet *set, int i) {
+	for(; i < nrules; i++)
+		if(HASBIT(set, i))
+			return i;
+	return -1;
+}
@@ -0,0 +1,36 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef _RULE_H
+#define _RULE_H
+#include <X11/Xlib.h>
+
+#define MAXRULES 256
+
+/* class, instance and title match any part of the window's strings, or
+ * the whole class and instance if exact is set. NULL matches anything. */
+typedef struct {
+	const char *class;
+	const char *instance;
+	const char *title;
+	unsigned int tags;
+	Bool isfloating;
+	int monitor;
+	Bool exact;
+} Rule;
+
+typedef struct {
+	unsigned long bits[MAXRULES / (8 * sizeof(unsigned long))];
+} RuleSet;
+
+/* Appends a rule, its strings are copied. Returns its index or -1. */
+int rule_add(const Rule *r);
+/* Drops all rules from index n on */
+void rule_truncate(int n);
+const Rule *rule_get(int i);
+/* Returns whether any rule looks at the title */
+Bool rule_hastitles(void);
+/* Sets the rules matching a window, classhash is strhash(class) */
+void rule_match(const char *class, unsigned int classhash, const char *instance,
+                const char *title, RuleSet *set);
+/* Returns the first rule in set from index i on, or -1 */
+int rule_next(const RuleSet *set, int i);
+#endif /* _RULE_H */
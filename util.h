@@ -3,9 +3,12 @@
 
 #define MAX(A, B)               ((A) > (B) ? (A) : (B))
 #define MIN(A, B)               ((A) < (B) ? (A) : (B))
+#define LENGTH(X)               (sizeof X / sizeof X[0])
 
 /* Functions from dwm.c */
 void spawn(const Arg *arg);
 unsigned int getsystraywidth();
+void *ecalloc(size_t nmemb, size_t size);
+void *erealloc(void *p, size_t size);
 
 enum { SchemeNorm, SchemeSel, SchemeLast }; /* color schemes */